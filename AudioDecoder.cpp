@@ -0,0 +1,386 @@
+#include "AudioDecoder.h"
+
+#include <chrono>
+#include <cmath>
+#include <cstring>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+// Matrixing and windowing of one block of 32 subband samples into 32 PCM
+// samples (ISO 11172-3, 2.4.3.2.2). Subbands from nr_of_subbands on are zero.
+//
+// history holds the last 16 blocks of V, position is where the new block goes.
+// The standard's U only takes the first half of every even block of V and the
+// second half of every odd one, so the window is applied to those directly.
+
+void mp2_synthesis_scalar(const float (*matrix)[64], const float *window,
+                          float (*history)[64], int position,
+                          const float *samples, int nr_of_subbands, int16_t *out) {
+    float *v = history[position];
+    for(int i = 0; i < 64; i++) {
+        v[i] = 0;
+    }
+
+    for(int k = 0; k < nr_of_subbands; k++) {
+        for(int i = 0; i < 64; i++) {
+            v[i] += matrix[k][i] * samples[k];
+        }
+    }
+
+    for(int j = 0; j < 32; j++) {
+        float sum = 0;
+        for(int i = 0; i < 8; i++) {
+            const float *even = history[(position + 2 * i) & (MP2_SYNTHESIS_BLOCKS - 1)];
+            const float *odd = history[(position + 2 * i + 1) & (MP2_SYNTHESIS_BLOCKS - 1)];
+
+            sum += even[j] * window[i * 64 + j];
+            sum += odd[32 + j] * window[i * 64 + 32 + j];
+        }
+
+        long sample = lrintf(sum);
+        out[j] = sample > INT16_MAX ? INT16_MAX : sample < INT16_MIN ? INT16_MIN : sample;
+    }
+}
+
+#ifdef __SSE2__
+
+// Same as mp2_synthesis_scalar, four values at a time
+void mp2_synthesis_sse2(const float (*matrix)[64], const float *window,
+                        float (*history)[64], int position,
+                        const float *samples, int nr_of_subbands, int16_t *out) {
+    __m128 v[16];
+    for(int i = 0; i < 16; i++) {
+        v[i] = _mm_setzero_ps();
+    }
+
+    for(int k = 0; k < nr_of_subbands; k++) {
+        __m128 sample = _mm_set1_ps(samples[k]);
+        for(int i = 0; i < 16; i++) {
+            v[i] = _mm_add_ps(v[i], _mm_mul_ps(_mm_load_ps(matrix[k] + i * 4), sample));
+        }
+    }
+
+    for(int i = 0; i < 16; i++) {
+        _mm_store_ps(history[position] + i * 4, v[i]);
+    }
+
+    __m128i pcm[4];
+    for(int j = 0; j < 32; j += 8) {
+        __m128 sum0 = _mm_setzero_ps();
+        __m128 sum1 = _mm_setzero_ps();
+
+        for(int i = 0; i < 8; i++) {
+            const float *even = history[(position + 2 * i) & (MP2_SYNTHESIS_BLOCKS - 1)] + j;
+            const float *odd = history[(position + 2 * i + 1) & (MP2_SYNTHESIS_BLOCKS - 1)] + 32 + j;
+            const float *w = window + i * 64 + j;
+
+            sum0 = _mm_add_ps(sum0, _mm_mul_ps(_mm_load_ps(even), _mm_load_ps(w)));
+            sum1 = _mm_add_ps(sum1, _mm_mul_ps(_mm_load_ps(even + 4), _mm_load_ps(w + 4)));
+            sum0 = _mm_add_ps(sum0, _mm_mul_ps(_mm_load_ps(odd), _mm_load_ps(w + 32)));
+            sum1 = _mm_add_ps(sum1, _mm_mul_ps(_mm_load_ps(odd + 4), _mm_load_ps(w + 36)));
+        }
+
+        // Round to nearest and saturate to 16 bits
+        pcm[j / 8] = _mm_packs_epi32(_mm_cvtps_epi32(sum0), _mm_cvtps_epi32(sum1));
+    }
+
+    for(int i = 0; i < 4; i++) {
+        _mm_storeu_si128((__m128i*)(out + i * 8), pcm[i]);
+    }
+}
+
+#endif
+
+AudioDecoder::AudioDecoder(BitStream *stream, AudioSink *sink) {
+    this->stream = stream;
+    this->sink = sink;
+
+    // Table B.1, index 63 is invalid
+    for(int i = 0; i < 63; i++) {
+        scalefactors[i] = (float)pow(2.0, 1.0 - i / 3.0);
+    }
+    scalefactors[63] = 0;
+
+    for(int k = 0; k < MP2_NR_OF_SUBBANDS; k++) {
+        for(int i = 0; i < 64; i++) {
+            synthesis_matrix[k][i] = (float)cos((16 + i) * (2 * k + 1) * M_PI / 64.0);
+        }
+    }
+
+    // 32 * C, scaled from 2^-21 units to the 16-bit output range
+    for(int i = 0; i < 257; i++) {
+        float value = MP2_WINDOW[i] * 32.0f * 32768.0f / (1 << 21);
+        synthesis_window[i] = value;
+
+        if(i > 0) {
+            synthesis_window[512 - i] = (i & 63) ? -value : value;
+        }
+    }
+
+    memset(quantizer, 0, sizeof(quantizer));
+    memset(synthesis_history, 0, sizeof(synthesis_history));
+}
+
+void AudioDecoder::decode() {
+    using std::chrono::high_resolution_clock;
+    using std::chrono::duration;
+
+    auto t1 = high_resolution_clock::now();
+
+    while(frame()) {
+        nr_of_frames++;
+    }
+
+    if(output_channels) {
+        sink->close();
+    }
+
+    auto t2 = high_resolution_clock::now();
+    decode_time = duration<double>(t2 - t1).count();
+}
+
+void AudioDecoder::print_stats() {
+    printf("Audio: %lu frames", nr_of_frames);
+
+    if(sample_rate && decode_time > 0) {
+        double seconds = (double)nr_of_samples / sample_rate;
+        printf(", %0.1f s decoded in %0.3f s (%0.0fx real time)",
+                seconds, decode_time, seconds / decode_time);
+    }
+
+    if(nr_of_skipped_bytes) {
+        printf(", skipped %lu bytes", nr_of_skipped_bytes);
+    }
+
+    printf("\n");
+}
+
+// Finds the next Layer II frame header and reads it, a byte at a time past
+// anything that doesn't look like one
+bool AudioDecoder::frame_header() {
+    stream->align();
+
+    while(stream->has_remaining(MP2_HEADER_SIZE << 3)) {
+        uint32_t header = (uint32_t)stream->peek(32);
+
+        int id = (header >> 19) & 0x01;
+        int layer = 4 - ((header >> 17) & 0x03);
+        int bit_rate_index = (header >> 12) & 0x0F;
+        int sample_rate_index = (header >> 10) & 0x03;
+
+        if((header >> 20) == MP2_FRAME_SYNC && id == MP2_ID_MPEG1 && layer == MP2_LAYER_II &&
+                bit_rate_index > 0 && bit_rate_index < 15 && sample_rate_index < 3) {
+            has_crc = ((header >> 16) & 0x01) == 0;
+            bit_rate = MP2_BIT_RATE[bit_rate_index];
+            sample_rate = MP2_SAMPLE_RATE[sample_rate_index];
+            padding = (header >> 9) & 0x01;
+            mode = (header >> 6) & 0x03;
+            mode_extension = (header >> 4) & 0x03;
+
+            nr_of_channels = mode == MP2_MODE_MONO ? 1 : 2;
+
+            int bit_rate_class = MP2_BIT_RATE_CLASS[nr_of_channels - 1][bit_rate_index];
+            int table = MP2_ALLOCATION_TABLE[bit_rate_class][sample_rate_index];
+            nr_of_subbands = MP2_TABLE_SUBBANDS[table];
+
+            bound = mode == MP2_MODE_JOINT_STEREO ? (mode_extension + 1) * 4 : nr_of_subbands;
+            if(bound > nr_of_subbands) {
+                bound = nr_of_subbands;
+            }
+
+            return true;
+        }
+
+        stream->skip(8);
+        nr_of_skipped_bytes++;
+    }
+
+    return false;
+}
+
+bool AudioDecoder::frame() {
+    if(!frame_header()) {
+        return false;
+    }
+
+    int frame_size = 144000 * bit_rate / sample_rate + padding;
+
+    // Everything below reads unchecked
+    if(!stream->has_remaining(frame_size << 3)) {
+        return false;
+    }
+
+    size_t frame_end = stream->bit_index + (frame_size << 3);
+    stream->skip_unchecked(MP2_HEADER_SIZE << 3);
+
+    if(has_crc) {
+        stream->skip_unchecked(16);
+    }
+
+    if(!output_channels) {
+        output_channels = nr_of_channels;
+        sink->open(sample_rate, output_channels);
+    }
+
+    read_allocation();
+    read_scalefactors();
+
+    // 3 parts of 4 granules of 3 samples per subband
+    int16_t *out = pcm;
+    for(int part = 0; part < 3; part++) {
+        for(int granule = 0; granule < 4; granule++) {
+            read_samples(part);
+
+            for(int t = 0; t < 3; t++) {
+                synthesis(t, out);
+                out += MP2_NR_OF_SUBBANDS * output_channels;
+            }
+        }
+    }
+
+    sink->write(pcm, MP2_SAMPLES_PER_FRAME);
+    nr_of_samples += MP2_SAMPLES_PER_FRAME;
+
+    // Skip ancillary data
+    stream->bit_index = frame_end;
+    return true;
+}
+
+void AudioDecoder::read_allocation() {
+    bool is_high_rate = nr_of_subbands > 12;
+
+    for(int sb = 0; sb < nr_of_subbands; sb++) {
+        const uint8_t *subband = is_high_rate ? MP2_HIGH_RATE_SUBBANDS[sb] : MP2_LOW_RATE_SUBBANDS[sb];
+        const uint8_t *row = MP2_QUANTIZER_INDEX[subband[1]];
+
+        for(int ch = 0; ch < nr_of_channels; ch++) {
+            // Past the bound both channels share one allocation
+            if(sb >= bound && ch > 0) {
+                quantizer[ch][sb] = quantizer[0][sb];
+                continue;
+            }
+
+            int index = row[stream->consume_unchecked(subband[0])];
+            quantizer[ch][sb] = index ? &MP2_QUANTIZERS[index] : nullptr;
+        }
+    }
+}
+
+void AudioDecoder::read_scalefactors() {
+    uint8_t selection[MP2_MAX_CHANNELS][MP2_NR_OF_SUBBANDS];
+
+    for(int sb = 0; sb < nr_of_subbands; sb++) {
+        for(int ch = 0; ch < nr_of_channels; ch++) {
+            if(quantizer[ch][sb]) {
+                selection[ch][sb] = stream->consume_unchecked(2);
+            }
+        }
+    }
+
+    // The selection information says which of the three parts share a
+    // scalefactor
+    for(int sb = 0; sb < nr_of_subbands; sb++) {
+        for(int ch = 0; ch < nr_of_channels; ch++) {
+            if(!quantizer[ch][sb]) {
+                continue;
+            }
+
+            uint8_t *scalefactor = scalefactor_index[ch][sb];
+            switch(selection[ch][sb]) {
+                case 0:
+                    scalefactor[0] = stream->consume_unchecked(6);
+                    scalefactor[1] = stream->consume_unchecked(6);
+                    scalefactor[2] = stream->consume_unchecked(6);
+                    break;
+                case 1:
+                    scalefactor[0] = scalefactor[1] = stream->consume_unchecked(6);
+                    scalefactor[2] = stream->consume_unchecked(6);
+                    break;
+                case 2:
+                    scalefactor[0] = scalefactor[1] = scalefactor[2] = stream->consume_unchecked(6);
+                    break;
+                case 3:
+                    scalefactor[0] = stream->consume_unchecked(6);
+                    scalefactor[1] = scalefactor[2] = stream->consume_unchecked(6);
+                    break;
+            }
+        }
+    }
+}
+
+// Reads one granule: three samples of every subband
+void AudioDecoder::read_samples(int part) {
+    for(int sb = 0; sb < nr_of_subbands; sb++) {
+        int coded_channels = sb < bound ? nr_of_channels : 1;
+
+        for(int ch = 0; ch < coded_channels; ch++) {
+            const MP2_Quantizer *q = quantizer[ch][sb];
+            int codes[3] = {0, 0, 0};
+
+            if(q) {
+                read_codes(q, codes);
+            }
+
+            // Past the bound the codes are scaled by each channel's own scalefactor
+            int last_channel = coded_channels == 1 ? nr_of_channels - 1 : ch;
+            for(int c = ch; c <= last_channel; c++) {
+                if(!q) {
+                    subband_samples[c][0][sb] = 0;
+                    subband_samples[c][1][sb] = 0;
+                    subband_samples[c][2][sb] = 0;
+                    continue;
+                }
+
+                // Requantize the code to (2 * code - (levels - 1)) / levels, the
+                // same as the standard's C * (s'' + D)
+                float scale = scalefactors[scalefactor_index[c][sb][part]] / q->levels;
+                for(int t = 0; t < 3; t++) {
+                    subband_samples[c][t][sb] = (2 * codes[t] - (q->levels - 1)) * scale;
+                }
+            }
+        }
+    }
+}
+
+void AudioDecoder::read_codes(const MP2_Quantizer *q, int *codes) {
+    if(q->grouped) {
+        int value = stream->consume_unchecked(q->bits);
+        codes[0] = value % q->levels;
+        value /= q->levels;
+        codes[1] = value % q->levels;
+        codes[2] = value / q->levels;
+    } else {
+        codes[0] = stream->consume_unchecked(q->bits);
+        codes[1] = stream->consume_unchecked(q->bits);
+        codes[2] = stream->consume_unchecked(q->bits);
+    }
+}
+
+// Turns sample t of the current granule into 32 PCM samples per output
+// channel, interleaved into out
+void AudioDecoder::synthesis(int t, int16_t *out) {
+    alignas(16) int16_t block[MP2_MAX_CHANNELS][MP2_NR_OF_SUBBANDS];
+
+    for(int ch = 0; ch < nr_of_channels; ch++) {
+        int position = synthesis_position[ch] = (synthesis_position[ch] - 1) & (MP2_SYNTHESIS_BLOCKS - 1);
+
+#ifdef __SSE2__
+        mp2_synthesis_sse2(synthesis_matrix, synthesis_window, synthesis_history[ch], position,
+                           subband_samples[ch][t], nr_of_subbands, block[ch]);
+#else
+        mp2_synthesis_scalar(synthesis_matrix, synthesis_window, synthesis_history[ch], position,
+                             subband_samples[ch][t], nr_of_subbands, block[ch]);
+#endif
+    }
+
+    // A mono frame in a stereo stream goes to both sides, a stereo frame in a
+    // mono stream only keeps the left one
+    for(int ch = 0; ch < output_channels; ch++) {
+        const int16_t *source = block[ch < nr_of_channels ? ch : 0];
+        for(int j = 0; j < MP2_NR_OF_SUBBANDS; j++) {
+            out[j * output_channels + ch] = source[j];
+        }
+    }
+}
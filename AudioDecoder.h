@@ -0,0 +1,223 @@
+#include "BitStream.h"
+#include "AudioSink.h"
+
+#define MP2_FRAME_SYNC                      0xFFF
+#define MP2_HEADER_SIZE                     4
+#define MP2_SAMPLES_PER_FRAME               1152
+#define MP2_NR_OF_SUBBANDS                  32
+#define MP2_MAX_CHANNELS                    2
+
+#define MP2_ID_MPEG1                        1
+#define MP2_LAYER_II                        2
+
+#define MP2_MODE_STEREO                     0
+#define MP2_MODE_JOINT_STEREO               1
+#define MP2_MODE_DUAL_CHANNEL               2
+#define MP2_MODE_MONO                       3
+
+// Synthesis history, 16 blocks of 64 values (V in the standard)
+#define MP2_SYNTHESIS_BLOCKS                16
+
+// In kbit/s, by bit rate index
+static const int MP2_BIT_RATE[] = {
+    0, 32, 48, 56, 64, 80, 96, 112, 128, 160, 192, 224, 256, 320, 384
+};
+
+static const int MP2_SAMPLE_RATE[] = {
+    44100, 48000, 32000
+};
+
+// Which allocation table (Table B.2) a frame uses depends on the bit rate per
+// channel and the sample rate. First the bit rate index is put in a class:
+// 32-48 kbit/s, 56-80 kbit/s and 96 kbit/s or more per channel.
+static const uint8_t MP2_BIT_RATE_CLASS[2][15] = {
+    // Mono
+    {0, 0, 0, 1, 1, 1, 2, 2, 2, 2, 2, 2, 2, 2, 2},
+    // Stereo, the bit rate covers both channels
+    {0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 2, 2, 2, 2, 2}
+};
+
+#define MP2_TABLE_A                         0 // B.2a, 27 subbands
+#define MP2_TABLE_B                         1 // B.2b, 30 subbands
+#define MP2_TABLE_C                         2 // B.2c, 8 subbands
+#define MP2_TABLE_D                         3 // B.2d, 12 subbands
+
+static const uint8_t MP2_ALLOCATION_TABLE[3][3] = {
+    // 44.1 kHz, 48 kHz, 32 kHz
+    {MP2_TABLE_C, MP2_TABLE_C, MP2_TABLE_D},
+    {MP2_TABLE_A, MP2_TABLE_A, MP2_TABLE_A},
+    {MP2_TABLE_B, MP2_TABLE_A, MP2_TABLE_B}
+};
+
+static const int MP2_TABLE_SUBBANDS[] = {27, 30, 8, 12};
+
+// Tables B.2a and B.2b (and B.2c and B.2d) only differ in their number of
+// subbands. Per subband: the number of allocation bits and the row of
+// MP2_QUANTIZER_INDEX the allocation is looked up in.
+static const uint8_t MP2_HIGH_RATE_SUBBANDS[30][2] = {
+    {4, 0}, {4, 0}, {4, 0},
+    {4, 1}, {4, 1}, {4, 1}, {4, 1}, {4, 1}, {4, 1}, {4, 1}, {4, 1},
+    {3, 2}, {3, 2}, {3, 2}, {3, 2}, {3, 2}, {3, 2}, {3, 2}, {3, 2}, {3, 2}, {3, 2}, {3, 2}, {3, 2},
+    {2, 3}, {2, 3}, {2, 3}, {2, 3}, {2, 3}, {2, 3}, {2, 3}
+};
+
+static const uint8_t MP2_LOW_RATE_SUBBANDS[12][2] = {
+    {4, 4}, {4, 4},
+    {3, 5}, {3, 5}, {3, 5}, {3, 5}, {3, 5}, {3, 5}, {3, 5}, {3, 5}, {3, 5}, {3, 5}
+};
+
+// Allocation to quantizer (an index into MP2_QUANTIZERS), 0 means the
+// subband isn't coded
+static const uint8_t MP2_QUANTIZER_INDEX[6][16] = {
+    {0, 1, 3, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15, 16, 17},
+    {0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 17},
+    {0, 1, 2, 3, 4, 5, 6, 17},
+    {0, 1, 2, 17},
+    {0, 1, 2, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15, 16},
+    {0, 1, 2, 4, 5, 6, 7, 8}
+};
+
+typedef struct {
+    int levels;
+    // Three samples are coded together in bits when grouped, otherwise each
+    // sample takes bits
+    bool grouped;
+    uint8_t bits;
+} MP2_Quantizer;
+
+// Table B.4
+static const MP2_Quantizer MP2_QUANTIZERS[18] = {
+    {0, false, 0},
+    {3, true, 5},
+    {5, true, 7},
+    {7, false, 3},
+    {9, true, 10},
+    {15, false, 4},
+    {31, false, 5},
+    {63, false, 6},
+    {127, false, 7},
+    {255, false, 8},
+    {511, false, 9},
+    {1023, false, 10},
+    {2047, false, 11},
+    {4095, false, 12},
+    {8191, false, 13},
+    {16383, false, 14},
+    {32767, false, 15},
+    {65535, false, 16}
+};
+
+// First half of the analysis window (C in Table B.3) in units of 2^-21, the
+// synthesis window is 32 times C. The second half mirrors it, negated except
+// for every 64th value.
+static const int32_t MP2_WINDOW[257] = {
+         0,     -1,     -1,     -1,     -1,     -1,     -1,     -2,
+        -2,     -2,     -2,     -3,     -3,     -4,     -4,     -5,
+        -5,     -6,     -7,     -7,     -8,     -9,    -10,    -11,
+       -13,    -14,    -16,    -17,    -19,    -21,    -24,    -26,
+       -29,    -31,    -35,    -38,    -41,    -45,    -49,    -53,
+       -58,    -63,    -68,    -73,    -79,    -85,    -91,    -97,
+      -104,   -111,   -117,   -125,   -132,   -139,   -147,   -154,
+      -161,   -169,   -176,   -183,   -190,   -196,   -202,   -208,
+       213,    218,    222,    225,    227,    228,    228,    227,
+       224,    221,    215,    208,    200,    189,    177,    163,
+       146,    127,    106,     83,     57,     29,     -2,    -36,
+       -72,   -111,   -153,   -197,   -244,   -294,   -347,   -401,
+      -459,   -519,   -581,   -645,   -711,   -779,   -848,   -919,
+      -991,  -1064,  -1137,  -1210,  -1283,  -1356,  -1428,  -1498,
+     -1567,  -1634,  -1698,  -1759,  -1817,  -1870,  -1919,  -1962,
+     -2001,  -2032,  -2057,  -2075,  -2085,  -2087,  -2080,  -2063,
+      2037,   2000,   1952,   1893,   1822,   1739,   1644,   1535,
+      1414,   1280,   1131,    970,    794,    605,    402,    185,
+       -45,   -288,   -545,   -814,  -1095,  -1388,  -1692,  -2006,
+     -2330,  -2663,  -3004,  -3351,  -3705,  -4063,  -4425,  -4788,
+     -5153,  -5517,  -5879,  -6237,  -6589,  -6935,  -7271,  -7597,
+     -7910,  -8209,  -8491,  -8755,  -8998,  -9219,  -9416,  -9585,
+     -9727,  -9838,  -9916,  -9959,  -9966,  -9935,  -9863,  -9750,
+     -9592,  -9389,  -9139,  -8840,  -8492,  -8092,  -7640,  -7134,
+      6574,   5959,   5288,   4561,   3776,   2935,   2037,   1082,
+        70,   -998,  -2122,  -3300,  -4533,  -5818,  -7154,  -8540,
+     -9975, -11455, -12980, -14548, -16155, -17799, -19478, -21189,
+    -22929, -24694, -26482, -28289, -30112, -31947, -33791, -35640,
+    -37489, -39336, -41176, -43006, -44821, -46617, -48390, -50137,
+    -51853, -53534, -55178, -56778, -58333, -59838, -61289, -62684,
+    -64019, -65290, -66494, -67629, -68692, -69679, -70590, -71420,
+    -72169, -72835, -73415, -73908, -74313, -74630, -74856, -74992,
+     75038
+};
+
+// One block of the polyphase synthesis filterbank: 32 subband samples in, 32
+// PCM samples out. The scalar version is the reference for the vectorized one.
+void mp2_synthesis_scalar(const float (*matrix)[64], const float *window,
+                          float (*history)[64], int position,
+                          const float *samples, int nr_of_subbands, int16_t *out);
+
+#ifdef __SSE2__
+void mp2_synthesis_sse2(const float (*matrix)[64], const float *window,
+                        float (*history)[64], int position,
+                        const float *samples, int nr_of_subbands, int16_t *out);
+#endif
+
+// MPEG-1 Layer II audio decoder
+//
+// Frames are read in one piece once their header has been found, so the
+// stream has to buffer contiguously (a root stream such as
+// Demuxer::audio_stream, not a chained one).
+class AudioDecoder {
+public:
+    AudioDecoder(BitStream*, AudioSink*);
+
+    // Decodes until the end of the stream
+    void decode();
+
+    void print_stats();
+
+private:
+    bool frame_header();
+    bool frame();
+    void read_allocation();
+    void read_scalefactors();
+    void read_samples(int part);
+    void read_codes(const MP2_Quantizer*, int*);
+    void synthesis(int channel, int16_t*);
+
+    BitStream *stream {nullptr};
+    AudioSink *sink {nullptr};
+
+    // Fields of the current frame header
+    bool has_crc {false};
+    int bit_rate {0};
+    int sample_rate {0};
+    bool padding {false};
+    int mode {0};
+    int mode_extension {0};
+
+    int nr_of_channels {0};
+    int nr_of_subbands {0};
+    // Subbands from bound on are coded once for both channels (intensity stereo)
+    int bound {0};
+
+    // Set by the first frame, later frames are mapped onto it
+    int output_channels {0};
+
+    const MP2_Quantizer *quantizer[MP2_MAX_CHANNELS][MP2_NR_OF_SUBBANDS];
+    uint8_t scalefactor_index[MP2_MAX_CHANNELS][MP2_NR_OF_SUBBANDS][3];
+
+    // Three samples of every subband for the current granule
+    alignas(16) float subband_samples[MP2_MAX_CHANNELS][3][MP2_NR_OF_SUBBANDS];
+
+    alignas(16) float synthesis_history[MP2_MAX_CHANNELS][MP2_SYNTHESIS_BLOCKS][64];
+    int synthesis_position[MP2_MAX_CHANNELS] {0, 0};
+
+    // Constants computed on construction
+    float scalefactors[64];
+    alignas(16) float synthesis_matrix[MP2_NR_OF_SUBBANDS][64];
+    alignas(16) float synthesis_window[512];
+
+    int16_t pcm[MP2_SAMPLES_PER_FRAME * MP2_MAX_CHANNELS];
+
+    size_t nr_of_frames {0};
+    size_t nr_of_samples {0};
+    size_t nr_of_skipped_bytes {0};
+    double decode_time {0};
+};
@@ -0,0 +1,81 @@
+#include "AudioSink.h"
+
+#include <cstring>
+
+#define WAV_HEADER_SIZE                     44
+#define WAV_FORMAT_PCM                      1
+
+static void put_le(uint8_t *p, uint32_t value, int nr_of_bytes) {
+    for(int i = 0; i < nr_of_bytes; i++) {
+        p[i] = (value >> (i * 8)) & 0xFF;
+    }
+}
+
+WavSink::WavSink(const char *path) {
+    fp = strcmp(path, "-") == 0 ? stdout : fopen(path, "wb");
+}
+
+WavSink::~WavSink() {
+    close();
+}
+
+void WavSink::open(int sample_rate, int nr_of_channels) {
+    this->sample_rate = sample_rate;
+    this->nr_of_channels = nr_of_channels;
+
+    write_header(UINT32_MAX - WAV_HEADER_SIZE);
+}
+
+void WavSink::write_header(uint32_t data_size) {
+    uint8_t header[WAV_HEADER_SIZE];
+    int block_align = nr_of_channels * 2;
+
+    memcpy(header, "RIFF", 4);
+    put_le(header + 4, data_size + WAV_HEADER_SIZE - 8, 4);
+    memcpy(header + 8, "WAVEfmt ", 8);
+    put_le(header + 16, 16, 4);
+    put_le(header + 20, WAV_FORMAT_PCM, 2);
+    put_le(header + 22, nr_of_channels, 2);
+    put_le(header + 24, sample_rate, 4);
+    put_le(header + 28, sample_rate * block_align, 4);
+    put_le(header + 32, block_align, 2);
+    put_le(header + 34, 16, 2);
+    memcpy(header + 36, "data", 4);
+    put_le(header + 40, data_size, 4);
+
+    fwrite(header, 1, WAV_HEADER_SIZE, fp);
+}
+
+void WavSink::write(const int16_t *samples, size_t nr_of_frames) {
+    size_t nr_of_samples = nr_of_frames * nr_of_channels;
+
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    fwrite(samples, 2, nr_of_samples, fp);
+#else
+    for(size_t i = 0; i < nr_of_samples; i++) {
+        uint8_t sample[2];
+        put_le(sample, (uint16_t)samples[i], 2);
+        fwrite(sample, 1, 2, fp);
+    }
+#endif
+
+    data_size += nr_of_samples * 2;
+}
+
+void WavSink::close() {
+    if(!fp) {
+        return;
+    }
+
+    // Only rewritten when the header was written by open()
+    if(sample_rate && fseek(fp, 0, SEEK_SET) == 0) {
+        write_header(data_size > UINT32_MAX - WAV_HEADER_SIZE ?
+                     UINT32_MAX - WAV_HEADER_SIZE : (uint32_t)data_size);
+    }
+
+    if(fp != stdout) {
+        fclose(fp);
+    }
+
+    fp = nullptr;
+}
@@ -0,0 +1,54 @@
+#pragma once
+
+#include <cstdio>
+#include <cstdint>
+#include <cstdlib>
+
+// Where decoded PCM goes
+class AudioSink {
+public:
+    virtual ~AudioSink() {}
+
+    // Called once before the first write
+    virtual void open(int sample_rate, int nr_of_channels) = 0;
+
+    // Takes nr_of_frames frames of interleaved 16-bit samples
+    virtual void write(const int16_t *samples, size_t nr_of_frames) = 0;
+
+    // Called after the last write
+    virtual void close() {}
+};
+
+// A 16-bit PCM WAV file. The sizes in the header are filled in by close(),
+// when the file can't be seeked (a pipe) they are left at their maximum.
+class WavSink : public AudioSink {
+public:
+    // A path of "-" writes to stdout
+    WavSink(const char*);
+    ~WavSink();
+
+    bool is_open() { return fp != nullptr; }
+
+    void open(int, int) override;
+    void write(const int16_t*, size_t) override;
+    void close() override;
+
+private:
+    void write_header(uint32_t data_size);
+
+    FILE *fp {nullptr};
+
+    int sample_rate {0};
+    int nr_of_channels {0};
+    size_t data_size {0};
+};
+
+// Throws the samples away, for measuring the decoder on its own
+class NullSink : public AudioSink {
+public:
+    void open(int, int nr_of_channels) override { this->nr_of_channels = nr_of_channels; }
+    void write(const int16_t*, size_t nr_of_frames) override { this->nr_of_frames += nr_of_frames; }
+
+    int nr_of_channels {0};
+    size_t nr_of_frames {0};
+};
@@ -1,45 +1,181 @@
 #include "BitStream.h"
+#include "StartCode.h"
+#include "ByteSource.h"
 
-BitStream::BitStream(FILE *fp) {
-    this->fp = fp;
+// An empty stream, only filled through reserve() and commit()
+BitStream::BitStream() {
+}
+
+BitStream::BitStream(ByteSource *source) {
+    this->source = source;
+
+    // Zero copy sources are read in place and never need loading
+    if(source->is_zero_copy()) {
+        data = (uint8_t*)source->data();
+        size = source->size();
+        total_read = size;
+        has_ended = true;
+    }
 }
 
 BitStream::BitStream(BitStream *parent) {
     this->parent_stream = parent;
 }
 
+BitStream::~BitStream() {
+    // Only a buffer allocated by reserve() is owned by the stream
+    if(capacity) {
+        free(data);
+    }
+}
+
 void BitStream::load_data() {
     if(load_callback) {
         load_callback(this, nullptr);
     }
 }
 
-int BitStream::peek(uint8_t nr_of_bits) {
-    if(!has_remaining(nr_of_bits)) {
-        return -1;
+void BitStream::next_start_code() {
+    align();
+    while(has_remaining(4 << 3)) {
+        size_t byte_index = bit_index >> 3;
+
+        // The prefix and the start code value byte both have to be buffered
+        const uint8_t *end = data + size - 1;
+        const uint8_t *found = find_start_code(data + byte_index, end);
+        if(found != end) {
+            bit_index = (found - data + 4) << 3;
+            start_code = found[3];
+            return;
+        }
+
+        // The last three bytes could be the start of a prefix that continues in
+        // data that has not been loaded yet
+        bit_index = (size - 3) << 3;
     }
 
-    size_t old_bit_index = bit_index;
-    int ret = consume(nr_of_bits);
-    bit_index = old_bit_index;
-    return ret;
+    start_code = -1;
 }
 
-void BitStream::next_start_code() {
+// Points destination at the bytes up to the next start code in place, when
+// they are in the data buffered right now (one view of a chained stream)
+// with at least BITSTREAM_PADDING bytes after them, so the unchecked reads
+// of destination stay inside. This stream is left on the start code, like
+// copy_until_start_code does. Fails without moving otherwise. destination
+// borrows the data until this stream loads again, it must not own a buffer.
+bool BitStream::view_until_start_code(BitStream *destination) {
     align();
-    while(has_remaining(5 << 3)) {
-        size_t byte_index = (bit_index) >> 3;
-        if(data[byte_index] == 0x00 &&
-            data[byte_index + 1] == 0x00 && 
-            data[byte_index + 2] == 0x01) {
-                bit_index = (byte_index + 4) << 3;
-                start_code = data[byte_index + 3];
-                return;
-            }
-            bit_index += 8;
+
+    size_t byte_index = bit_index >> 3;
+    if(byte_index >= size) {
+        return false;
     }
 
-    start_code = -1;
+    const uint8_t *end = data + size - 1;
+    const uint8_t *found = find_start_code(data + byte_index, end);
+    if(found == end || (size_t)(found - data) + BITSTREAM_PADDING > size) {
+        return false;
+    }
+
+    destination->data = data + byte_index;
+    destination->size = found - data - byte_index;
+    destination->total_read = destination->size;
+    destination->bit_index = 0;
+    destination->has_ended = true;
+    destination->reservoir_index = BITSTREAM_INVALID_RESERVOIR;
+
+    bit_index = (found - data) << 3;
+    return true;
+}
+
+// Copies the bytes up to the next start code into destination, replacing
+// its contents. This stream is left on the start code so the checked path
+// still parses it, destination ends in zeroed padding and can be read with
+// the unchecked functions.
+void BitStream::copy_until_start_code(BitStream *destination) {
+    destination->clear();
+    align();
+
+    while(has_remaining(4 << 3)) {
+        size_t byte_index = bit_index >> 3;
+
+        const uint8_t *end = data + size - 1;
+        const uint8_t *found = find_start_code(data + byte_index, end);
+
+        // Keep the last three bytes when there is no start code, they could be
+        // the start of one that continues in data that has not been loaded yet
+        size_t copy_end = found != end ? found - data : size - 3;
+
+        memcpy(destination->reserve(copy_end - byte_index), data + byte_index, copy_end - byte_index);
+        destination->commit(copy_end - byte_index);
+        bit_index = copy_end << 3;
+
+        if(found != end) {
+            return;
+        }
+    }
+
+    // The stream ended without another start code
+    size_t byte_index = bit_index >> 3;
+    if(byte_index < size) {
+        memcpy(destination->reserve(size - byte_index), data + byte_index, size - byte_index);
+        destination->commit(size - byte_index);
+        bit_index = size << 3;
+    }
+}
+
+// Drops all data, the buffer is kept for reuse. Positions carry on after the
+// dropped data. A chained stream drops its views and releases them in the
+// parent.
+void BitStream::clear() {
+    size = 0;
+    bit_index = 0;
+    window_offset = total_read;
+    reservoir_index = BITSTREAM_INVALID_RESERVOIR;
+
+    if(parent_stream) {
+        views.clear();
+        queued_length = 0;
+        current_view = {0, 0};
+        in_bridge = false;
+        bridge_head = 0;
+        data = nullptr;
+
+        parent_stream->pinned_offset = (size_t)-1;
+    }
+}
+
+bool BitStream::seek(size_t position) {
+    if(parent_stream) {
+        return false;
+    }
+
+    start_code = 0;
+
+    if(position >= window_offset && position <= window_offset + size) {
+        bit_index = (position - window_offset) << 3;
+        return true;
+    }
+
+    if(!source || !source->seek(position)) {
+        return false;
+    }
+
+    clear();
+    window_offset = position;
+    has_ended = false;
+    return true;
+}
+
+size_t BitStream::position() {
+    size_t byte_index = bit_index >> 3;
+    if(!parent_stream) {
+        return window_offset + byte_index;
+    }
+
+    // Whatever was added but isn't left in data or queued has been read
+    size_t unread = byte_index < size ? size - byte_index : 0;
+    return total_read - unread - queued_length;
 }
 
 bool BitStream::no_start_code() {
@@ -75,37 +211,235 @@ void BitStream::align() {
     bit_index = ((bit_index + 7) >> 3) << 3;
 }
 
-bool BitStream::has_remaining(int nr_of_bits) {
-    if((size << 3) - bit_index >= nr_of_bits) {
-        return true;
+// Returns room for nr_of_bytes at the end of the buffer, dropping bytes that
+// have already been read before growing it. A buffer below window_size (it
+// was widened after the buffer was allocated) grows to it.
+uint8_t* BitStream::reserve(size_t nr_of_bytes) {
+    if(size + nr_of_bytes > capacity) {
+        compact();
     }
 
-    if(load_callback) {
-        load_callback(this, load_callback_data);
+    if(size + nr_of_bytes > capacity || capacity < window_size) {
+        capacity = size + nr_of_bytes > window_size ? size + nr_of_bytes : window_size;
+        data = (uint8_t*)realloc(data, capacity + BITSTREAM_PADDING);
+    }
+
+    return data + size;
+}
+
+// Adds nr_of_bytes written after reserve() to the stream
+void BitStream::commit(size_t nr_of_bytes) {
+    size += nr_of_bytes;
+    total_read += nr_of_bytes;
+    memset(data + size, 0, BITSTREAM_PADDING);
+
+    // The reservoir may hold padding bytes that were just overwritten
+    reservoir_index = BITSTREAM_INVALID_RESERVOIR;
+}
+
+// Moves the unread (or pinned) bytes to the start of the buffer
+void BitStream::compact() {
+    size_t consumed = bit_index >> 3;
+    if(consumed > size) {
+        consumed = size;
+    }
+
+    if(pinned_offset - window_offset < consumed) {
+        consumed = pinned_offset - window_offset;
+    }
+
+    if(consumed == 0) {
+        return;
+    }
+
+    memmove(data, data + consumed, size - consumed);
+
+    size -= consumed;
+    bit_index -= consumed << 3;
+    window_offset += consumed;
+
+    reservoir_index = BITSTREAM_INVALID_RESERVOIR;
+}
+
+// Slow path of has_remaining, keeps loading until enough bits are buffered
+// or the stream has ended
+bool BitStream::load_remaining(int nr_of_bits) {
+    if(parent_stream) {
+        return load_views(nr_of_bits);
+    }
+
+    while(bit_index + nr_of_bits > (size << 3)) {
+        if(has_ended) {
+            return false;
+        }
+
+        if(source) {
+            size_t read = source->read(reserve(BITSTREAM_READ_SIZE), BITSTREAM_READ_SIZE);
+            commit(read);
+
+            if(read == 0) {
+                has_ended = true;
+            }
+        } else if(load_callback) {
+            load_callback(this, load_callback_data);
+        } else {
+            return false;
+        }
     }
 
-    return !has_ended;
+    return true;
 }
 
-int BitStream::consume(uint8_t nr_of_bits) {
-    if(!has_remaining(nr_of_bits)) {
-        return -1;
+void BitStream::refill() {
+    // Unchecked reads can run past the end, which is read as zeros
+    if((bit_index >> 3) >= size) {
+        reservoir = 0;
+        reservoir_index = (bit_index >> 3) << 3;
+        return;
     }
 
-    int value = 0;
-    while(nr_of_bits) {
-        int current_byte = data[bit_index >> 3];
+    uint64_t value;
+    memcpy(&value, data + (bit_index >> 3), sizeof(value));
+
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    value = __builtin_bswap64(value);
+#endif
+
+    reservoir = value;
+    reservoir_index = (bit_index >> 3) << 3;
+}
+
+// Appends length bytes of the parent stream, starting at parent stream
+// position offset, to a chained stream. The bytes must already be loaded in
+// the parent and stay pinned there until they have been read.
+void BitStream::add_view(size_t offset, size_t length) {
+    if(length == 0) {
+        return;
+    }
+
+    views.push_back({offset, length});
+    queued_length += length;
+    total_read += length;
+
+    update_pin();
+}
+
+uint8_t* BitStream::view_data(size_t offset) {
+    return parent_stream->data + (offset - parent_stream->window_offset);
+}
+
+// Reads the parent's bytes of view in place, starting at byte_position
+void BitStream::read_view(BitStreamView view, size_t byte_position) {
+    current_view = view;
+    in_bridge = false;
+    bridge_head = 0;
+
+    data = view_data(view.offset);
+    size = view.length;
+    bit_index = (byte_position << 3) | (bit_index & 7);
+
+    reservoir_index = BITSTREAM_INVALID_RESERVOIR;
+}
+
+void BitStream::update_view() {
+    if(parent_stream && !in_bridge && data) {
+        data = view_data(current_view.offset);
+        reservoir_index = BITSTREAM_INVALID_RESERVOIR;
+    }
+}
+
+void BitStream::update_pin() {
+    size_t pin = (size_t)-1;
+
+    if(!in_bridge && data) {
+        pin = current_view.offset;
+    } else if(!views.empty()) {
+        pin = views.front().offset - bridge_head;
+    }
+
+    parent_stream->pinned_offset = pin;
+}
+
+// Slow path of has_remaining for chained streams. Moves on to the next view
+// when the current one is used up, going through the bridge when a read
+// crosses the boundary between two views.
+bool BitStream::load_views(int nr_of_bits) {
+    if(nr_of_bits > (BITSTREAM_BRIDGE_SIZE / 2) << 3) {
+        return false;
+    }
+
+    while(bit_index + nr_of_bits > (size << 3)) {
+        size_t read_bytes = bit_index >> 3;
+        size_t unread = read_bytes < size ? size - read_bytes : 0;
+        size_t head = in_bridge ? bridge_head : 0;
+
+        // Continue in the next view itself once everything that is left to
+        // read was taken from it
+        if(head >= unread && !views.empty()) {
+            BitStreamView view = views.front();
+            views.pop_front();
+            queued_length -= view.length;
+
+            view.offset -= head;
+            view.length += head;
+            read_view(view, head - unread);
+            update_pin();
+            continue;
+        }
+
+        if(views.empty()) {
+            if(!load_callback || has_ended) {
+                return false;
+            }
+
+            load_callback(this, load_callback_data);
+
+            // Loading may have moved the parent's buffer
+            update_view();
+            continue;
+        }
+
+        // Copy what is left of the current data and the start of the next
+        // views into the bridge
+        memmove(bridge, data + size - unread, unread);
+
+        size_t filled = unread;
+        if(head > unread) {
+            head = unread;
+        }
+
+        while(filled < BITSTREAM_BRIDGE_SIZE && !views.empty()) {
+            BitStreamView &view = views.front();
+
+            size_t take = BITSTREAM_BRIDGE_SIZE - filled;
+            if(take > view.length) {
+                take = view.length;
+            }
+
+            memcpy(bridge + filled, view_data(view.offset), take);
+            view.offset += take;
+            view.length -= take;
+            queued_length -= take;
+
+            filled += take;
+            head += take;
+
+            if(view.length == 0) {
+                views.pop_front();
+                head = 0;
+            }
+        }
 
-        int remaining = 8 - (bit_index & 7);
-        int read = remaining < nr_of_bits ? remaining : nr_of_bits;
-        int shift = remaining - read;
-        int mask = (0xFF >> (8 - read));
+        in_bridge = true;
+        bridge_head = head;
 
-        value = (value << read) | ((current_byte & (mask << shift)) >> shift);
+        data = bridge;
+        size = filled;
+        bit_index &= 7;
 
-        bit_index += read;
-        nr_of_bits -= read;
+        reservoir_index = BITSTREAM_INVALID_RESERVOIR;
+        update_pin();
     }
 
-    return value;
+    return true;
 }
\ No newline at end of file
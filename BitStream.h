@@ -1,43 +1,199 @@
+#pragma once
+
 #include <cstdio>
 #include <cstdint>
 #include <cstdlib>
 #include <cstring>
+#include <deque>
+
+// Bytes allocated (and zeroed) after the end of every BitStream buffer so the
+// reservoir can always refill with a single 8 byte load
+#define BITSTREAM_PADDING                   8
+
+// Number of bytes read from a ByteSource at once
+#define BITSTREAM_READ_SIZE                 1024*32
+
+// Default capacity of the buffered window of a stream. Bytes before the read
+// position are dropped when new data no longer fits.
+#define BITSTREAM_DEFAULT_WINDOW_SIZE       1024*256
+
+// Size of the buffer used to read across the boundary between two views of a
+// chained stream. A single read on a chained stream can't be longer than half of it.
+#define BITSTREAM_BRIDGE_SIZE               64
+
+// Reservoir position that can never be served from (see BitStream::reservoir_index)
+#define BITSTREAM_INVALID_RESERVOIR         ((size_t)-64)
 
 class BitStream;
+class ByteSource;
 
 typedef void (*stream_load_callback)(BitStream* self, void *data);
 
+// Byte range of the parent stream, in parent stream positions (see window_offset)
+typedef struct {
+    size_t offset;
+    size_t length;
+} BitStreamView;
+
 class BitStream {
 public:
-    BitStream(FILE*);
+    BitStream();
+    BitStream(ByteSource*);
     BitStream(BitStream*);
+    ~BitStream();
 
     void load_data();
-    int consume(uint8_t);
-    bool has_remaining(int);
+    inline int consume(uint8_t);
+    inline bool has_remaining(int);
     void next_start_code();
     void align();
     int skip_bytes_while(int);
     void skip(size_t);
     bool no_start_code();
-    int peek(uint8_t);
+    inline int peek(uint8_t);
+
+    // Reads without checking or loading what is buffered, for streams that
+    // hold all of their data (see view_until_start_code and
+    // copy_until_start_code). They stay in memory past the end of the data
+    // but don't read zeros there: after a view come the bytes of the next
+    // start code, after a copy the zeroed padding. Callers stop by bit count
+    // (size << 3).
+    inline int consume_unchecked(uint8_t);
+    inline int peek_unchecked(uint8_t);
+    inline void skip_unchecked(uint8_t);
+
+    bool view_until_start_code(BitStream*);
+    void copy_until_start_code(BitStream*);
+    void clear();
 
-    BitStream* parent_stream;
+    // Moves a root stream to a source position, buffered data is dropped
+    // unless the position is in it. Fails when the source can't seek.
+    bool seek(size_t);
+
+    // Stream position of the next unread byte. For a chained stream this
+    // counts the bytes of all its views, for a root stream it is the offset in
+    // the source.
+    size_t position();
+
+    uint8_t* reserve(size_t);
+    void commit(size_t);
+    void compact();
+
+    void add_view(size_t, size_t);
+
+    // Points a chained stream at its current view again, for when the
+    // parent's buffer moved while another stream was loading
+    void update_view();
+
+    BitStream* parent_stream {nullptr};
 
     stream_load_callback load_callback {nullptr};
     void* load_callback_data {nullptr};
 
-    FILE *fp {nullptr};
+    ByteSource *source {nullptr};
 
     size_t bit_index {0};
     size_t total_read {0};
     size_t size {0};
     size_t capacity {0};
-    
+
+    // Capacity the buffer is kept at, it only grows past this when a single
+    // load doesn't fit next to the unread data. A chained stream has no
+    // buffer of its own, the window of its parent holds its views.
+    size_t window_size {BITSTREAM_DEFAULT_WINDOW_SIZE};
+
+    // Stream position of data[0], the number of bytes dropped by compact()
+    size_t window_offset {0};
+
+    // compact() keeps every byte from this stream position on, a chained child
+    // stream pins the views it still has to read
+    size_t pinned_offset {(size_t)-1};
+
     int start_code {0};
     int type {0};
 
     bool has_ended {false};
 
     uint8_t *data {nullptr};
-};
\ No newline at end of file
+
+private:
+    bool load_remaining(int);
+    bool load_views(int);
+    void refill();
+    inline uint32_t show_bits(uint8_t);
+
+    uint8_t* view_data(size_t);
+    void read_view(BitStreamView, size_t);
+    void update_pin();
+
+    // A chained stream (one with a parent) doesn't own its data. It reads the
+    // parent's bytes in place, one view at a time, and only copies the few
+    // bytes around a view boundary into the bridge.
+    std::deque<BitStreamView> views;
+    // Total length of views
+    size_t queued_length {0};
+    BitStreamView current_view {0, 0};
+    bool in_bridge {false};
+
+    // Number of bytes at the end of the bridge that were taken from the front
+    // of views.front()
+    size_t bridge_head {0};
+    uint8_t bridge[BITSTREAM_BRIDGE_SIZE + BITSTREAM_PADDING];
+
+    // 64 bits of data starting at the (byte aligned) bit position reservoir_index.
+    // An invalid reservoir is placed just below the wrap-around point so that
+    // bit_index - reservoir_index is always larger than 32 and forces a refill.
+    uint64_t reservoir {0};
+    size_t reservoir_index {BITSTREAM_INVALID_RESERVOIR};
+};
+
+inline bool BitStream::has_remaining(int nr_of_bits) {
+    if(bit_index + nr_of_bits <= (size << 3)) {
+        return true;
+    }
+
+    return load_remaining(nr_of_bits);
+}
+
+// Returns the next nr_of_bits (at most 32) without any bounds checking
+inline uint32_t BitStream::show_bits(uint8_t nr_of_bits) {
+    size_t offset = bit_index - reservoir_index;
+    if(offset > 32) {
+        refill();
+        offset = bit_index & 7;
+    }
+
+    return (uint32_t)(((reservoir << offset) >> 32) >> (32 - nr_of_bits));
+}
+
+inline int BitStream::peek(uint8_t nr_of_bits) {
+    if(!has_remaining(nr_of_bits)) {
+        return -1;
+    }
+
+    return show_bits(nr_of_bits);
+}
+
+inline int BitStream::consume(uint8_t nr_of_bits) {
+    if(!has_remaining(nr_of_bits)) {
+        return -1;
+    }
+
+    int value = show_bits(nr_of_bits);
+    bit_index += nr_of_bits;
+    return value;
+}
+
+inline int BitStream::consume_unchecked(uint8_t nr_of_bits) {
+    int value = show_bits(nr_of_bits);
+    bit_index += nr_of_bits;
+    return value;
+}
+
+inline int BitStream::peek_unchecked(uint8_t nr_of_bits) {
+    return show_bits(nr_of_bits);
+}
+
+inline void BitStream::skip_unchecked(uint8_t nr_of_bits) {
+    bit_index += nr_of_bits;
+}
@@ -0,0 +1,136 @@
+#include "ByteSource.h"
+#include "BitStream.h"
+
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+FileSource::FileSource(const char *path, bool use_mmap) {
+    fp = fopen(path, "rb");
+    if(!fp) {
+        return;
+    }
+
+    struct stat file_stat;
+    if(fstat(fileno(fp), &file_stat) == 0 && S_ISREG(file_stat.st_mode)) {
+        is_regular_file = true;
+        file_size = file_stat.st_size;
+    }
+
+    if(use_mmap && is_regular_file && file_size) {
+        map_file();
+    }
+}
+
+FileSource::~FileSource() {
+    if(mapped_size) {
+        munmap(mapping, mapped_size);
+    }
+
+    if(fp) {
+        fclose(fp);
+    }
+}
+
+// Maps the file over a zeroed anonymous reservation that is a little larger,
+// so the padding after the last byte is always readable
+bool FileSource::map_file() {
+    size_t page_size = sysconf(_SC_PAGESIZE);
+    size_t region_size = (file_size + BITSTREAM_PADDING + page_size - 1) / page_size * page_size;
+
+    void *region = mmap(nullptr, region_size, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(region == MAP_FAILED) {
+        return false;
+    }
+
+    if(mmap(region, file_size, PROT_READ, MAP_PRIVATE | MAP_FIXED, fileno(fp), 0) == MAP_FAILED) {
+        munmap(region, region_size);
+        return false;
+    }
+
+    madvise(region, file_size, MADV_SEQUENTIAL);
+
+    mapping = (uint8_t*)region;
+    mapped_size = region_size;
+    return true;
+}
+
+size_t FileSource::read(uint8_t *destination, size_t size) {
+    if(!fp) {
+        return 0;
+    }
+
+    if(!mapped_size) {
+        return fread(destination, sizeof(uint8_t), size, fp);
+    }
+
+    if(size > file_size - position) {
+        size = file_size - position;
+    }
+
+    memcpy(destination, mapping + position, size);
+    position += size;
+    return size;
+}
+
+bool FileSource::seek(size_t position) {
+    if(!is_regular_file || position > file_size) {
+        return false;
+    }
+
+    if(mapped_size) {
+        this->position = position;
+        return true;
+    }
+
+    return fseeko(fp, position, SEEK_SET) == 0;
+}
+
+MemorySource::MemorySource(const uint8_t *data, size_t size) {
+    buffer = (uint8_t*)malloc(size + BITSTREAM_PADDING);
+    buffer_size = size;
+
+    memcpy(buffer, data, size);
+    memset(buffer + size, 0, BITSTREAM_PADDING);
+}
+
+MemorySource::~MemorySource() {
+    free(buffer);
+}
+
+size_t MemorySource::read(uint8_t *destination, size_t size) {
+    if(size > buffer_size - position) {
+        size = buffer_size - position;
+    }
+
+    memcpy(destination, buffer + position, size);
+    position += size;
+    return size;
+}
+
+bool MemorySource::seek(size_t position) {
+    if(position > buffer_size) {
+        return false;
+    }
+
+    this->position = position;
+    return true;
+}
+
+PipeSource::PipeSource(int fd) {
+    this->fd = fd;
+}
+
+size_t PipeSource::read(uint8_t *destination, size_t size) {
+    while(true) {
+        ssize_t nr_read = ::read(fd, destination, size);
+        if(nr_read >= 0) {
+            return nr_read;
+        }
+
+        if(errno != EINTR) {
+            return 0;
+        }
+    }
+}
@@ -0,0 +1,88 @@
+#pragma once
+
+#include <cstdio>
+#include <cstdint>
+#include <cstdlib>
+
+// Where the bytes of the root BitStream come from
+class ByteSource {
+public:
+    virtual ~ByteSource() {}
+
+    // Copies up to size bytes into destination, returns 0 at the end of the input
+    virtual size_t read(uint8_t *destination, size_t size) = 0;
+
+    // Moves the read position, only supported when is_seekable()
+    virtual bool seek(size_t) { return false; }
+    virtual bool is_seekable() { return false; }
+
+    // A zero copy source exposes the whole input as a single buffer that stays
+    // valid as long as the source exists and is followed by BITSTREAM_PADDING
+    // zeroed bytes, the BitStream then reads it in place
+    virtual bool is_zero_copy() { return false; }
+    virtual const uint8_t* data() { return nullptr; }
+    virtual size_t size() { return 0; }
+};
+
+// A file on disk, memory mapped when it is a regular file
+class FileSource : public ByteSource {
+public:
+    FileSource(const char*, bool use_mmap = true);
+    ~FileSource();
+
+    bool is_open() { return fp != nullptr; }
+
+    size_t read(uint8_t*, size_t) override;
+    bool seek(size_t) override;
+    bool is_seekable() override { return is_regular_file; }
+
+    bool is_zero_copy() override { return mapped_size != 0; }
+    const uint8_t* data() override { return mapping; }
+    size_t size() override { return file_size; }
+
+private:
+    bool map_file();
+
+    FILE *fp {nullptr};
+
+    bool is_regular_file {false};
+    size_t file_size {0};
+
+    // The mapping covers the file plus padding, mapped_size is 0 when the
+    // file is read instead
+    uint8_t *mapping {nullptr};
+    size_t mapped_size {0};
+    size_t position {0};
+};
+
+// A buffer in memory, copied once on construction so it can be padded
+class MemorySource : public ByteSource {
+public:
+    MemorySource(const uint8_t*, size_t);
+    ~MemorySource();
+
+    size_t read(uint8_t*, size_t) override;
+    bool seek(size_t) override;
+    bool is_seekable() override { return true; }
+
+    bool is_zero_copy() override { return true; }
+    const uint8_t* data() override { return buffer; }
+    size_t size() override { return buffer_size; }
+
+private:
+    uint8_t *buffer {nullptr};
+    size_t buffer_size {0};
+    size_t position {0};
+};
+
+// Anything that can only be read front to back: a pipe, stdin or a socket.
+// Reads return whatever is available instead of waiting for a full chunk.
+class PipeSource : public ByteSource {
+public:
+    PipeSource(int fd);
+
+    size_t read(uint8_t*, size_t) override;
+
+private:
+    int fd {-1};
+};
@@ -1,187 +1,771 @@
 #include "Demuxer.h"
 
-#define DEFAULT_READ_SIZE                   1024*32
+#include <algorithm>
+#include <cstring>
+#include <unistd.h>
 
-#define MPEG1_VIDEO_PACKET_START_CODE       0xE0
-#define MPEG1_AUDIO_PACKET_START_CODE       0xC0
-// TODO: Support multiple audio streams
+#define MPEG1_VIDEO_PACKET_START_CODE_FIRST 0xE0
+#define MPEG1_VIDEO_PACKET_START_CODE_LAST  0xEF
+#define MPEG1_AUDIO_PACKET_START_CODE_FIRST 0xC0
+#define MPEG1_AUDIO_PACKET_START_CODE_LAST  0xDF
+
+#define MPEG1_PACK_START_CODE               0xBA
+#define MPEG1_SYSTEM_HEADER_START_CODE      0xBB
+
+// Every stream id from here on starts a packet with a length
+#define MPEG1_FIRST_PACKET_START_CODE       0xBC
+
+// Mux rate and rate bound are in units of 50 bytes/second
+#define MPEG1_MUX_RATE_UNIT                 50
 
 #define MPEG1_PACKET_TYPE_VIDEO             1
 #define MPEG1_PACKET_TYPE_AUDIO             2
 
+#define TS_PACKET_SIZE                      188
+#define TS_SYNC_BYTE                        0x47
+
+// Packets read looking for the PMT before a seek, PSI repeats much more often
+#define TS_MAX_PSI_INTERVAL                 4096
+
+#define TS_PAT_PID                          0x0000
+#define TS_PAT_TABLE_ID                     0x00
+#define TS_PMT_TABLE_ID                     0x02
+
+// PMT stream types
+#define TS_STREAM_TYPE_MPEG1_VIDEO          0x01
+#define TS_STREAM_TYPE_MPEG2_VIDEO          0x02
+#define TS_STREAM_TYPE_MPEG1_AUDIO          0x03
+#define TS_STREAM_TYPE_MPEG2_AUDIO          0x04
+
+static size_t pes_header(const uint8_t*, size_t, double *pts);
+static double pes_time(const uint8_t*);
+
+void load_packet_from_parent(BitStream *self, void *data) {
+    auto demuxer = (Demuxer*)data;
+
+    // Packets of the other stream are handed to it on the way
+    size_t total_read = self->total_read;
+    while(!self->has_ended && self->total_read == total_read) {
+        demuxer->read_packet();
+    }
+
+    // Reading may have moved the file stream's buffer under the video stream
+    if(self != demuxer->video_stream) {
+        demuxer->video_stream->update_view();
+    }
+}
+
+BitStream *Demuxer::read_packet() {
+    if(is_transport_stream) {
+        return read_transport_packets();
+    }
+
+    // Find the pack header, system header or packet
+    do {
+        file_stream->next_start_code();
+    } while(file_stream->start_code != -1 &&
+            file_stream->start_code < MPEG1_PACK_START_CODE);
+
+    if(file_stream->start_code == -1) {
+        video_stream->has_ended = true;
+        audio_stream->has_ended = true;
+        return nullptr;
+    }
+
+    int start_code = file_stream->start_code;
 
-void load_data_from_file(BitStream *self, void *data) {
-    if(!self->fp) {
-        fputs("No file pointer was given!", stderr);
-        exit(1);
+    if(start_code == MPEG1_PACK_START_CODE) {
+        read_pack_header();
+        return nullptr;
     }
 
-    if(self->data) { 
-        self->data = (uint8_t*)realloc(self->data, DEFAULT_READ_SIZE + self->size);
-    } else { // First packet
-        self->data = (uint8_t*)malloc(DEFAULT_READ_SIZE * sizeof(uint8_t));
-        self->size = 0;
+    if(start_code == MPEG1_SYSTEM_HEADER_START_CODE) {
+        read_system_header();
+        return nullptr;
     }
 
-    size_t read = fread(self->data + self->size, sizeof(uint8_t), 
-                        DEFAULT_READ_SIZE, self->fp);
+    bool is_video = start_code >= MPEG1_VIDEO_PACKET_START_CODE_FIRST &&
+                    start_code <= MPEG1_VIDEO_PACKET_START_CODE_LAST;
+    bool is_audio = start_code >= MPEG1_AUDIO_PACKET_START_CODE_FIRST &&
+                    start_code <= MPEG1_AUDIO_PACKET_START_CODE_LAST;
 
-    // printf("Read %lu\n", read);
-    self->total_read += read;
-    self->size += read;
+    if(is_video && video_stream_id == DEMUXER_FIRST_STREAM) {
+        video_stream_id = start_code;
+    }
 
-    if(read == 0) {
-        self->has_ended = true;
+    if(is_audio && audio_stream_id == DEMUXER_FIRST_STREAM) {
+        audio_stream_id = start_code;
     }
+
+    // A damaged packet is dropped, the next read resyncs at the start code after it
+    MPEG1_Packet packet;
+
+    if(is_video && start_code == video_stream_id) {
+        if(!get_packet(MPEG1_PACKET_TYPE_VIDEO, &packet)) {
+            return nullptr;
+        }
+
+        add_video_packet(packet);
+        return video_stream;
+    }
+
+    if(is_audio && start_code == audio_stream_id) {
+        if(!get_packet(MPEG1_PACKET_TYPE_AUDIO, &packet)) {
+            return nullptr;
+        }
+
+        add_audio_packet(packet);
+        return audio_stream;
+    }
+
+    skip_packet();
+    return nullptr;
 }
 
-void load_packet_from_parent(BitStream *self, void *data) {
-    auto demuxer = (Demuxer*)data;
-    BitStream *parent = demuxer->file_stream;
+bool Demuxer::seek(size_t offset) {
+    // The PIDs to demux come from the PMT, which can be anywhere before offset
+    if(is_transport_stream) {
+        for(int i = 0; !has_program_map && !video_stream->has_ended && i < TS_MAX_PSI_INTERVAL;
+                i += DEMUXER_TS_BATCH_SIZE) {
+            read_transport_packets();
+        }
+    }
 
-    // Find the packet
-    do {
-        parent->next_start_code();
-    } while(parent->start_code != MPEG1_VIDEO_PACKET_START_CODE &&
-            parent->start_code != MPEG1_AUDIO_PACKET_START_CODE && 
-            parent->start_code != -1);
+    if(!file_stream->seek(offset)) {
+        return false;
+    }
+
+    video_stream->clear();
+    video_stream->has_ended = false;
+    video_stream->start_code = 0;
+
+    audio_stream->clear();
+    audio_stream->has_ended = false;
+    audio_stream->start_code = 0;
+
+    video_packets.clear();
+
+    // Payload before the next PES header belongs to a packet that was skipped
+    video_transport = {};
+    audio_transport = {};
+
+    // The next SCR isn't a discontinuity
+    system_clock_reference = -1;
+    return true;
+}
+
+void Demuxer::read_pack_header() {
+    size_t offset = file_stream->position() - 4;
+
+    // '0010' (an MPEG-2 pack starts with '01' and isn't parsed), SCR, marker
+    // bit, mux rate and marker bit
+    if(!file_stream->has_remaining(8 << 3) || file_stream->peek(4) != 0x02) {
+        return;
+    }
+
+    file_stream->skip(4);
+    double scr = decode_time(file_stream);
+    file_stream->skip(1);
+    size_t rate = (size_t)file_stream->consume(22) * MPEG1_MUX_RATE_UNIT;
+    file_stream->skip(1);
+
+    if(system_clock_reference >= 0) {
+        double gap = scr - system_clock_reference;
+        if(gap < 0 || gap > DEMUXER_MAX_SCR_GAP) {
+            scr_discontinuities++;
+        }
+    }
+
+    system_clock_reference = scr;
+    mux_rate = rate;
+    pack_offset = offset;
+    nr_of_packs++;
+
+    size_read_ahead(mux_rate);
+}
+
+void Demuxer::read_system_header() {
+    if(!file_stream->has_remaining(16)) {
+        return;
+    }
+
+    size_t length = file_stream->consume(16);
+    if(!file_stream->has_remaining(length << 3)) {
+        return;
+    }
+
+    // All of the header is buffered now, so bit positions stay valid
+    size_t end = file_stream->bit_index + (length << 3);
+    if(length < 6) {
+        file_stream->bit_index = end;
+        return;
+    }
+
+    MPEG1_SystemHeader header;
+
+    // Marker bit
+    file_stream->skip(1);
+    header.rate_bound = (size_t)file_stream->consume(22) * MPEG1_MUX_RATE_UNIT;
+    // Marker bit
+    file_stream->skip(1);
+
+    header.audio_bound = file_stream->consume(6);
+    header.fixed_bitrate = file_stream->consume(1);
+    header.constrained = file_stream->consume(1);
+    header.audio_lock = file_stream->consume(1);
+    header.video_lock = file_stream->consume(1);
+
+    // Marker bit
+    file_stream->skip(1);
+    header.video_bound = file_stream->consume(5);
+
+    // Reserved byte
+    file_stream->skip(8);
+
+    // Stream id (its first bit is always set), '11', buffer bound scale
+    // (128 or 1024 bytes) and size bound
+    while(file_stream->bit_index + 24 <= end && file_stream->peek(1) == 1) {
+        int stream_id = file_stream->consume(8);
+        file_stream->skip(2);
+        size_t unit = file_stream->consume(1) ? 1024 : 128;
+        size_t size_bound = file_stream->consume(13);
+
+        header.streams.push_back({stream_id, size_bound * unit});
+    }
+
+    file_stream->bit_index = end;
+
+    system_header = header;
+    has_system_header = true;
+
+    size_read_ahead(header.rate_bound);
+}
+
+// Grows the read ahead to DEMUXER_READ_AHEAD_TIME at rate, it never shrinks
+void Demuxer::size_read_ahead(size_t rate) {
+    if(!read_ahead) {
+        return;
+    }
+
+    read_ahead->grow(std::min((size_t)(rate * DEMUXER_READ_AHEAD_TIME), (size_t)DEMUXER_MAX_READ_AHEAD_SIZE));
+}
+
+double Demuxer::system_clock_at(size_t offset) {
+    if(system_clock_reference < 0 || !mux_rate) {
+        return system_clock_reference;
+    }
+
+    return system_clock_reference + ((double)offset - (double)pack_offset) / mux_rate;
+}
+
+// Hands the packet payload to the video stream as a view of the file stream,
+// no bytes are copied
+void Demuxer::add_video_packet(MPEG1_Packet packet) {
+    if(track_video_packets) {
+        video_packets.push_back({video_stream->total_read, packet.offset, packet.pts});
+    }
+
+    size_t parent_position = file_stream->window_offset + (file_stream->bit_index >> 3);
+    video_stream->add_view(parent_position, packet.length);
+
+    file_stream->skip(packet.length << 3);
+}
+
+// Audio is copied out instead, a view would keep the file stream window from
+// moving on while nothing reads the audio
+void Demuxer::add_audio_packet(MPEG1_Packet packet) {
+    add_audio_data(file_stream->data + (file_stream->bit_index >> 3), packet.length);
+    file_stream->skip(packet.length << 3);
+}
+
+void Demuxer::add_audio_data(const uint8_t *data, size_t length) {
+    // Drop the oldest audio rather than buffer without a bound
+    size_t unread = audio_stream->size - (audio_stream->bit_index >> 3);
+    if(unread + length > DEMUXER_AUDIO_BUFFER_SIZE) {
+        size_t dropped = std::min(unread, unread + length - DEMUXER_AUDIO_BUFFER_SIZE);
+        audio_stream->bit_index += dropped << 3;
+        audio_dropped += dropped;
+    }
+
+    memcpy(audio_stream->reserve(length), data, length);
+    audio_stream->commit(length);
+}
+
+// Demuxes a batch of transport stream packets, returns the stream that got
+// data (video first), nullptr when neither did
+BitStream *Demuxer::read_transport_packets() {
+    size_t video_read = video_stream->total_read;
+    size_t audio_read = audio_stream->total_read;
+
+    for(int i = 0; i < DEMUXER_TS_BATCH_SIZE; i++) {
+        if(!file_stream->has_remaining(TS_PACKET_SIZE << 3)) {
+            video_stream->has_ended = true;
+            audio_stream->has_ended = true;
+            break;
+        }
+
+        size_t byte_index = file_stream->bit_index >> 3;
+        const uint8_t *packet = file_stream->data + byte_index;
+        bool in_sync = packet[0] == TS_SYNC_BYTE;
+
+        // Payload can contain the sync byte as well, so after losing sync the
+        // next packet has to start with one too
+        if(in_sync && lost_sync && file_stream->has_remaining((2 * TS_PACKET_SIZE) << 3)) {
+            byte_index = file_stream->bit_index >> 3;
+            packet = file_stream->data + byte_index;
+            in_sync = packet[TS_PACKET_SIZE] == TS_SYNC_BYTE;
+        }
+
+        // Resync a byte at a time
+        if(!in_sync) {
+            if(!lost_sync) {
+                sync_losses++;
+                lost_sync = true;
+            }
+
+            file_stream->bit_index += 8;
+            continue;
+        }
+
+        lost_sync = false;
+
+        read_transport_packet(packet, file_stream->window_offset + byte_index);
+        file_stream->bit_index += TS_PACKET_SIZE << 3;
+        nr_of_transport_packets++;
+    }
+
+    if(video_stream->total_read != video_read) {
+        return video_stream;
+    }
+
+    if(audio_stream->total_read != audio_read) {
+        return audio_stream;
+    }
+
+    return nullptr;
+}
+
+void Demuxer::read_transport_packet(const uint8_t *packet, size_t offset) {
+    // Transport error indicator
+    if(packet[1] & 0x80) {
+        transport_errors++;
+        return;
+    }
+
+    bool unit_start = packet[1] & 0x40;
+    int pid = ((packet[1] & 0x1F) << 8) | packet[2];
+    int adaptation_field_control = (packet[3] >> 4) & 0x03;
+    int continuity_counter = packet[3] & 0x0F;
+
+    // Adaptation field only
+    if(!(adaptation_field_control & 0x01)) {
+        return;
+    }
+
+    const uint8_t *payload = packet + 4;
+    const uint8_t *end = packet + TS_PACKET_SIZE;
+
+    bool discontinuity = false;
+    if(adaptation_field_control & 0x02) {
+        discontinuity = payload[0] > 0 && (payload[1] & 0x80);
+        payload += 1 + payload[0];
+    }
+
+    if(payload >= end) {
+        return;
+    }
+
+    if(pid == TS_PAT_PID) {
+        if(unit_start) {
+            read_program_association(payload, end);
+        }
+        return;
+    }
+
+    if(pid == pmt_pid) {
+        if(unit_start) {
+            read_program_map(payload, end);
+        }
+        return;
+    }
+
+    MPEG1_TransportPID *transport;
+    int type;
 
-    if(parent->start_code == -1) {
-        self->has_ended = true;
+    if(pid == video_pid && video_stream_id != DEMUXER_NO_STREAM) {
+        transport = &video_transport;
+        type = MPEG1_PACKET_TYPE_VIDEO;
+    } else if(pid == audio_pid && audio_stream_id != DEMUXER_NO_STREAM) {
+        transport = &audio_transport;
+        type = MPEG1_PACKET_TYPE_AUDIO;
+    } else {
         return;
     }
 
-    MPEG1_Packet packet = demuxer->get_packet(parent->start_code);
-    demuxer->add_packet(self, packet);
+    // A packet may be sent twice, the repeat is dropped. After a missing
+    // packet the rest of the PES is.
+    if(transport->continuity_counter != -1 && !discontinuity) {
+        if(continuity_counter == transport->continuity_counter) {
+            return;
+        }
+
+        if(continuity_counter != ((transport->continuity_counter + 1) & 0x0F)) {
+            continuity_errors++;
+            transport->in_pes = false;
+        }
+    }
+
+    transport->continuity_counter = continuity_counter;
+
+    add_transport_payload(transport, type, payload, end, unit_start, offset);
+}
+
+void Demuxer::add_transport_payload(MPEG1_TransportPID *transport, int type, const uint8_t *payload,
+                                    const uint8_t *end, bool unit_start, size_t offset) {
+    if(unit_start) {
+        double pts = -1;
+        size_t header_size = pes_header(payload, end - payload, &pts);
+
+        transport->in_pes = header_size != 0;
+        if(!transport->in_pes) {
+            return;
+        }
+
+        payload += header_size;
+
+        if(type == MPEG1_PACKET_TYPE_VIDEO && track_video_packets) {
+            video_packets.push_back({video_stream->total_read, offset, pts});
+        }
+    }
+
+    if(!transport->in_pes || payload == end) {
+        return;
+    }
 
-    // Check if the correct packet was read 
-    // if not read another packet
-    if(self->type != packet.type) {
-        load_packet_from_parent(self, data);
+    if(type == MPEG1_PACKET_TYPE_VIDEO) {
+        memcpy(video_stream->reserve(end - payload), payload, end - payload);
+        video_stream->commit(end - payload);
+    } else {
+        add_audio_data(payload, end - payload);
     }
 }
 
-void Demuxer::add_packet(BitStream *self, MPEG1_Packet packet) {
-    if(!self->data) {
-        self->data = (uint8_t*)malloc(packet.length * sizeof(uint8_t));
-        self->size = 0;
+// Only the first program is played. Sections have to fit in the packet they
+// start in, which the PAT and PMT of a few programs always do.
+void Demuxer::read_program_association(const uint8_t *payload, const uint8_t *end) {
+    // Pointer field
+    const uint8_t *section = payload + 1 + payload[0];
+    if(section + 8 > end || section[0] != TS_PAT_TABLE_ID) {
+        return;
+    }
+
+    size_t section_length = ((section[1] & 0x0F) << 8) | section[2];
+    if(section_length < 9 || section + 3 + section_length > end) {
+        return;
+    }
+
+    // Without the CRC
+    const uint8_t *entries_end = section + 3 + section_length - 4;
+
+    // Program number and PMT PID, program 0 gives the network PID instead
+    for(const uint8_t *program = section + 8; program + 4 <= entries_end; program += 4) {
+        int program_number = (program[0] << 8) | program[1];
+        if(program_number != 0) {
+            pmt_pid = ((program[2] & 0x1F) << 8) | program[3];
+            return;
+        }
+    }
+}
+
+void Demuxer::read_program_map(const uint8_t *payload, const uint8_t *end) {
+    const uint8_t *section = payload + 1 + payload[0];
+    if(section + 12 > end || section[0] != TS_PMT_TABLE_ID) {
+        return;
+    }
+
+    size_t section_length = ((section[1] & 0x0F) << 8) | section[2];
+    if(section_length < 13 || section + 3 + section_length > end) {
+        return;
+    }
+
+    // Without the CRC
+    const uint8_t *streams_end = section + 3 + section_length - 4;
+
+    size_t program_info_length = ((section[10] & 0x0F) << 8) | section[11];
+
+    // Stream type, PID and descriptors
+    const uint8_t *stream = section + 12 + program_info_length;
+    while(stream + 5 <= streams_end) {
+        int stream_type = stream[0];
+        int pid = ((stream[1] & 0x1F) << 8) | stream[2];
+        size_t es_info_length = ((stream[3] & 0x0F) << 8) | stream[4];
+
+        bool is_video = stream_type == TS_STREAM_TYPE_MPEG1_VIDEO ||
+                        stream_type == TS_STREAM_TYPE_MPEG2_VIDEO;
+        bool is_audio = stream_type == TS_STREAM_TYPE_MPEG1_AUDIO ||
+                        stream_type == TS_STREAM_TYPE_MPEG2_AUDIO;
+
+        if(is_video && video_pid == DEMUXER_FIRST_STREAM) {
+            video_pid = pid;
+        }
+
+        if(is_audio && audio_pid == DEMUXER_FIRST_STREAM) {
+            audio_pid = pid;
+        }
+
+        stream += 5 + es_info_length;
+    }
+
+    has_program_map = true;
+}
+
+// Size of the PES header at the start of size bytes, 0 when it isn't one or
+// doesn't fit. A transport stream carries MPEG-2 PES headers, the MPEG-1
+// syntax of a program stream is accepted as well.
+static size_t pes_header(const uint8_t *header, size_t size, double *pts) {
+    if(size < 9 || header[0] != 0x00 || header[1] != 0x00 || header[2] != 0x01) {
+        return 0;
+    }
+
+    // '10', flags, PTS/DTS flags and header data length
+    if((header[6] & 0xC0) == 0x80) {
+        size_t header_size = 9 + header[8];
+        if(header_size > size) {
+            return 0;
+        }
+
+        if((header[7] & 0x80) && header_size >= 14) {
+            *pts = pes_time(header + 9);
+        }
+
+        return header_size;
+    }
+
+    // Stuffing, P-STD and PTS/DTS as in get_packet()
+    size_t i = 6;
+    while(i < size && header[i] == 0xFF) {
+        i++;
+    }
+
+    if(i < size && (header[i] & 0xC0) == 0x40) {
+        i += 2;
+    }
+
+    if(i >= size) {
+        return 0;
+    }
+
+    size_t time_size = 0;
+    if((header[i] & 0xF0) == 0x30) {
+        time_size = 10;
+    } else if((header[i] & 0xF0) == 0x20) {
+        time_size = 5;
+    } else if(header[i] == 0x0F) {
+        return i + 1;
     } else {
-        self->data = (uint8_t*)realloc(self->data, self->size + packet.length);
+        return 0;
     }
 
-    size_t parent_byte_pos = file_stream->bit_index >> 3;
-    memcpy(self->data + self->size, file_stream->data + parent_byte_pos, packet.length);
+    if(i + time_size > size) {
+        return 0;
+    }
+
+    *pts = pes_time(header + i);
+    return i + time_size;
+}
+
+// A 33 bit time in 5 bytes with marker bits, in seconds
+static double pes_time(const uint8_t *time) {
+    int64_t clock = (int64_t)((time[0] >> 1) & 0x07) << 30 |
+                    (int64_t)time[1] << 22 |
+                    (int64_t)(time[2] >> 1) << 15 |
+                    (int64_t)time[3] << 7 |
+                    (time[4] >> 1);
+
+    return (double)clock/90000.0;
+}
 
-    self->total_read += packet.length;
-    self->size += packet.length;
+const MPEG1_PacketPosition* Demuxer::video_packet_at(size_t position) {
+    while(video_packets.size() > 1 && video_packets[1].stream_position <= position) {
+        video_packets.pop_front();
+    }
+
+    if(video_packets.empty() || video_packets.front().stream_position > position) {
+        return nullptr;
+    }
 
-    file_stream->skip(packet.length);
+    return &video_packets.front();
 }
 
-Demuxer::Demuxer(const char *file) {
-    fp = fopen(file, "rb");
+void Demuxer::skip_packet() {
+    if(!file_stream->has_remaining(16)) {
+        return;
+    }
 
-    file_stream = new BitStream(fp);
-    file_stream->load_callback = load_data_from_file;
+    size_t length = file_stream->consume(16);
+    if(file_stream->has_remaining(length << 3)) {
+        file_stream->skip(length << 3);
+    }
+}
+
+Demuxer::Demuxer(const char *file, bool use_mmap, size_t read_ahead_size) {
+    if(strcmp(file, "-") == 0) {
+        owned_source = new PipeSource(STDIN_FILENO);
+    } else {
+        auto file_source = new FileSource(file, use_mmap);
+        if(!file_source->is_open()) {
+            fprintf(stderr, "Unable to open %s\n", file);
+            exit(1);
+        }
 
-    // Demux into (audio and) video stream
-    video_stream = new BitStream(file_stream);
+        owned_source = file_source;
+    }
+
+    init(owned_source, read_ahead_size);
+}
+
+Demuxer::Demuxer(ByteSource *source, size_t read_ahead_size) {
+    init(source, read_ahead_size);
+}
+
+void Demuxer::init(ByteSource *source, size_t read_ahead_size) {
+    // Sources that can't be read in place are read in chunks, on the I/O
+    // thread unless read ahead is disabled
+    if(!source->is_zero_copy() && read_ahead_size) {
+        read_ahead = new ReadAhead(source, read_ahead_size, BITSTREAM_READ_SIZE);
+        source = read_ahead;
+    }
+
+    file_stream = new BitStream(source);
+
+    // A transport stream has a sync byte every 188 bytes, a capture can
+    // start in the middle of a packet
+    if(file_stream->has_remaining((3 * TS_PACKET_SIZE) << 3)) {
+        const uint8_t *data = file_stream->data + (file_stream->bit_index >> 3);
+        for(int i = 0; i < TS_PACKET_SIZE && !is_transport_stream; i++) {
+            is_transport_stream = data[i] == TS_SYNC_BYTE &&
+                                  data[i + TS_PACKET_SIZE] == TS_SYNC_BYTE &&
+                                  data[i + 2 * TS_PACKET_SIZE] == TS_SYNC_BYTE;
+        }
+    }
+
+    // Demux into (audio and) video stream. Transport stream payload is split
+    // into many small pieces, it is copied out instead of viewed. Viewed
+    // video is buffered in the window of file_stream, which is what
+    // VideoDecoder::sequence_header() sizes from the VBV buffer size.
+    video_stream = is_transport_stream ? new BitStream() : new BitStream(file_stream);
     video_stream->load_callback = load_packet_from_parent;
     video_stream->load_callback_data = this;
     video_stream->type = MPEG1_PACKET_TYPE_VIDEO;
 
+    audio_stream = new BitStream();
+    audio_stream->load_callback = load_packet_from_parent;
+    audio_stream->load_callback_data = this;
+    audio_stream->type = MPEG1_PACKET_TYPE_AUDIO;
+    audio_stream->window_size = DEMUXER_AUDIO_BUFFER_SIZE;
 }
 
 Demuxer::~Demuxer() {
-    fclose(fp);
+    delete video_stream;
+    delete audio_stream;
+    delete file_stream;
+
+    delete read_ahead;
+    delete owned_source;
+}
 
-    if(file_stream->data) {
-        free(file_stream->data);
+void Demuxer::print_stats() {
+    printf("Read: %lu bytes\n", file_stream->total_read);
+
+    if(read_ahead) {
+        printf("Waited on I/O: %0.3f ms (%lu times)\n",
+                read_ahead->wait_time * 1000.0, read_ahead->nr_of_waits);
     }
 
-    if(video_stream->data) {
-        free(video_stream->data);
+    if(audio_dropped) {
+        printf("Dropped unread audio: %lu bytes\n", audio_dropped);
     }
 
-    delete file_stream;
-    delete video_stream;
-}
+    if(is_transport_stream) {
+        printf("Transport packets: %lu, errors: %lu, continuity errors: %lu, sync losses: %lu\n",
+                nr_of_transport_packets, transport_errors, continuity_errors, sync_losses);
+    }
 
-MPEG1_Packet Demuxer::get_packet(int start_code) {
-    if(start_code == MPEG1_VIDEO_PACKET_START_CODE) {
-        return get_video_packet();
-    } else if(start_code == MPEG1_AUDIO_PACKET_START_CODE) {
-        return get_audio_packet();
-    } else {
-        fputs("Unknown packet given!", stderr);
-        exit(1);
+    if(packet_errors) {
+        printf("Damaged packets: %lu\n", packet_errors);
+    }
+
+    if(nr_of_packs) {
+        printf("Packs: %lu, mux rate: %lu bytes/s, SCR discontinuities: %lu\n",
+                nr_of_packs, mux_rate, scr_discontinuities);
     }
 }
 
-MPEG1_Packet Demuxer::get_video_packet() {
-    MPEG1_Packet packet;
-    packet.type = MPEG1_PACKET_TYPE_VIDEO;
+// Parses the header of a video or audio packet, leaving file_stream at the
+// payload. A header that is damaged, or a packet cut off by the end of the
+// file, is counted in packet_errors and fails.
+bool Demuxer::get_packet(int type, MPEG1_Packet *packet) {
+    packet->type = type;
+    packet->offset = file_stream->position() - 4;
 
     if(!file_stream->has_remaining(16)) {
-        fputs("Unable to read packet length", stderr);
-        exit(1);
+        packet_errors++;
+        return false;
     }
 
-    packet.length = file_stream->consume(16);
+    packet->length = file_stream->consume(16);
 
-    if(!file_stream->has_remaining(packet.length)) {
-        fputs("Packet is corrupt", stderr);
-        exit(1);
+    if(!file_stream->has_remaining(packet->length << 3)) {
+        packet_errors++;
+        return false;
     }
 
-    packet.length -= file_stream->skip_bytes_while(0xFF);
+    packet->length -= file_stream->skip_bytes_while(0xFF);
 
-    // Skip P-STD
-    if(file_stream->consume(2) == 0x01) {
-        file_stream->skip_bytes_while(16);
-        packet.length -= 2;
+    // Skip P-STD: '01', buffer scale and buffer size
+    if(file_stream->peek(2) == 0x01) {
+        file_stream->skip(16);
+        packet->length -= 2;
     }
 
-    int pts_dts_marker = file_stream->consume(2);
+    int pts_dts_marker = file_stream->consume(4);
     if(pts_dts_marker == 0x03) {
-        packet.pts = decode_time(file_stream);
-        last_decoded_pts = packet.pts;
+        packet->pts = decode_time(file_stream);
+        last_decoded_pts = packet->pts;
 
         // Skip DTS
         file_stream->skip(40);
 
-        packet.length -= 10;
+        packet->length -= 10;
     } else if(pts_dts_marker == 0x02) {
-        packet.pts = decode_time(file_stream);
-        last_decoded_pts = packet.pts;
+        packet->pts = decode_time(file_stream);
+        last_decoded_pts = packet->pts;
 
-        packet.length -= 5;
+        packet->length -= 5;
     } else if(pts_dts_marker == 0x00) {
-        packet.pts = -1;
+        packet->pts = -1;
 
         file_stream->skip(4);
 
-        packet.length -= 1;
+        packet->length -= 1;
     } else {
-        fputs("Invalid PTS/DTS marker", stderr);
-        exit(1);
+        packet_errors++;
+        return false;
     }
 
-    return packet;
-}
-
-MPEG1_Packet Demuxer::get_audio_packet() {
-    MPEG1_Packet packet;
-    packet.type = MPEG1_PACKET_TYPE_AUDIO;
+    if(packet->length < 0) {
+        packet_errors++;
+        return false;
+    }
 
-    return packet;
+    return true;
 }
 
 double Demuxer::decode_time(BitStream *stream) {
-    int64_t clock = stream->consume(3) << 30;
+    int64_t clock = (int64_t)stream->consume(3) << 30;
     // Marker bit
     stream->skip(1);
-    clock |= stream->consume(15) << 15;
+    clock |= (int64_t)stream->consume(15) << 15;
     // Marker bit
     stream->skip(1);
     clock |= stream->consume(15);
@@ -1,28 +1,188 @@
-#include "VideoDecoder.h"
+#include "BitStream.h"
+#include "ReadAhead.h"
+
+#include <vector>
+
+class VideoDecoder;
+
+// Bytes the I/O thread keeps read ahead of the parser when the input isn't mapped
+#define DEFAULT_READ_AHEAD_SIZE             1024*1024
+
+// Unread audio kept before the oldest is dropped, several seconds at MPEG-1
+// audio bit rates
+#define DEMUXER_AUDIO_BUFFER_SIZE           1024*256
+
+// Stream selections besides a stream id (see Demuxer::video_stream_id)
+#define DEMUXER_FIRST_STREAM                -1
+#define DEMUXER_NO_STREAM                   -2
+
+// Seconds of the stream, at the declared mux rate, kept read ahead, and the
+// most that is ever kept
+#define DEMUXER_READ_AHEAD_TIME             1.0
+#define DEMUXER_MAX_READ_AHEAD_SIZE         1024*1024*16
+
+// Transport stream packets demuxed per read_packet() call
+#define DEMUXER_TS_BATCH_SIZE               64
+
+// Consecutive SCRs are at most 0.7 seconds apart, a larger gap (or one
+// backwards) is a discontinuity
+#define DEMUXER_MAX_SCR_GAP                 0.7
 
 typedef struct {
     int type {0};
     int length {0};
     double pts {0.0};
+    // File offset of the packet start code
+    size_t offset {0};
 } MPEG1_Packet;
 
+// A stream listed in the system header
+typedef struct {
+    int stream_id;
+    // P-STD buffer size bound in bytes
+    size_t buffer_size_bound;
+} MPEG1_SystemStream;
+
+typedef struct {
+    // No pack has a higher mux rate, in bytes/second
+    size_t rate_bound {0};
+    int audio_bound {0};
+    int video_bound {0};
+    bool fixed_bitrate {false};
+    bool constrained {false};
+    bool audio_lock {false};
+    bool video_lock {false};
+    std::vector<MPEG1_SystemStream> streams;
+} MPEG1_SystemHeader;
+
+// Reassembly state of a PID demuxed from a transport stream
+typedef struct {
+    // Of the last packet, -1 when the next one can't be checked
+    int continuity_counter {-1};
+    // Set from a PES header on, a missing packet clears it until the next one
+    bool in_pes {false};
+} MPEG1_TransportPID;
+
+// Where a video packet's payload starts in the video stream and in the file
+typedef struct {
+    size_t stream_position;
+    size_t offset;
+    // -1 when the packet has no PTS
+    double pts;
+} MPEG1_PacketPosition;
+
 class Demuxer {
 public:
-    Demuxer(const char*);
+    // A path of "-" reads from stdin
+    Demuxer(const char*, bool use_mmap = true,
+            size_t read_ahead_size = DEFAULT_READ_AHEAD_SIZE);
+    // The source isn't owned and has to outlive the demuxer
+    Demuxer(ByteSource*, size_t read_ahead_size = DEFAULT_READ_AHEAD_SIZE);
     ~Demuxer();
 
-    MPEG1_Packet get_packet(int);
-    void add_packet(BitStream*, MPEG1_Packet);
+    void print_stats();
+
+    // Demuxes the next packet into its stream and returns that stream,
+    // nullptr for packets of other streams and at the end of the file. A
+    // transport stream is demuxed DEMUXER_TS_BATCH_SIZE packets at a time.
+    BitStream *read_packet();
+
+    // Continues demuxing at file offset, which has to be the start of a pack
+    // or packet. Everything buffered in the streams is dropped. Fails when the
+    // input can't seek (stdin).
+    bool seek(size_t offset);
+
+    // Stream ids demuxed into video_stream (0xE0-0xEF) and audio_stream
+    // (0xC0-0xDF). DEMUXER_FIRST_STREAM picks the first one found, after
+    // which the id is set. Packets of every other stream, and of both with
+    // DEMUXER_NO_STREAM, are skipped without being copied.
+    int video_stream_id {DEMUXER_FIRST_STREAM};
+    int audio_stream_id {DEMUXER_FIRST_STREAM};
+
+    // Keeps the position of every video packet for video_packet_at()
+    bool track_video_packets {false};
+
+    // The video packet that video stream position lies in, nullptr if it
+    // isn't demuxed yet. Earlier packets are forgotten, so positions have to
+    // be asked for in increasing order.
+    const MPEG1_PacketPosition* video_packet_at(size_t position);
+
+    // The system clock at file offset, extrapolated at the mux rate from the
+    // SCR of the last pack header. -1 before the first pack.
+    double system_clock_at(size_t offset);
+
+    // From the last pack header, the SCR is in seconds and the mux rate in
+    // bytes/second
+    double system_clock_reference {-1};
+    size_t mux_rate {0};
+    // File offset of that pack header
+    size_t pack_offset {0};
+
+    size_t nr_of_packs {0};
+    size_t scr_discontinuities {0};
+
+    // Program stream packets dropped for a damaged header
+    size_t packet_errors {0};
+
+    // Valid once has_system_header
+    MPEG1_SystemHeader system_header;
+    bool has_system_header {false};
+
+    // The input is a transport stream (188 byte packets) rather than a
+    // program stream. Its video and audio are reassembled from the PIDs
+    // below into the same streams, copied instead of viewed.
+    bool is_transport_stream {false};
+
+    // PIDs demuxed from a transport stream. DEMUXER_FIRST_STREAM takes the
+    // first video (or audio) stream of the first program in the PMT.
+    // video_stream_id and audio_stream_id can still turn a stream off.
+    int video_pid {DEMUXER_FIRST_STREAM};
+    int audio_pid {DEMUXER_FIRST_STREAM};
+
+    size_t nr_of_transport_packets {0};
+    size_t transport_errors {0};
+    size_t continuity_errors {0};
+    size_t sync_losses {0};
 
     BitStream *file_stream {nullptr};
     BitStream *video_stream {nullptr};
     BitStream *audio_stream {nullptr};
 
 private:
-    FILE *fp;
+    void init(ByteSource*, size_t read_ahead_size);
+
+    // Only set when the demuxer opened the source itself
+    ByteSource *owned_source {nullptr};
+
+    ReadAhead *read_ahead {nullptr};
+
+    bool get_packet(int type, MPEG1_Packet*);
+    void add_video_packet(MPEG1_Packet);
+    void add_audio_packet(MPEG1_Packet);
+    void add_audio_data(const uint8_t*, size_t);
+    void skip_packet();
+
+    BitStream *read_transport_packets();
+    void read_transport_packet(const uint8_t*, size_t offset);
+    void read_program_association(const uint8_t*, const uint8_t *end);
+    void read_program_map(const uint8_t*, const uint8_t *end);
+    void add_transport_payload(MPEG1_TransportPID*, int type, const uint8_t*, const uint8_t *end,
+                               bool unit_start, size_t offset);
+
+    void read_pack_header();
+    void read_system_header();
+    void size_read_ahead(size_t rate);
+
+    std::deque<MPEG1_PacketPosition> video_packets;
+
+    size_t audio_dropped {0};
 
-    MPEG1_Packet get_video_packet();
-    MPEG1_Packet get_audio_packet();
+    // Found in the PAT, -1 until then
+    int pmt_pid {-1};
+    bool has_program_map {false};
+    MPEG1_TransportPID video_transport;
+    MPEG1_TransportPID audio_transport;
+    bool lost_sync {false};
 
     double decode_time(BitStream*);
 
@@ -0,0 +1,82 @@
+#include "DisplayQueue.h"
+
+#include <cstdlib>
+
+DisplayQueue::DisplayQueue(size_t capacity) {
+    this->capacity = capacity;
+    frames = (DisplayFrame*)malloc(capacity * sizeof(DisplayFrame));
+
+    pthread_mutex_init(&mutex, NULL);
+    pthread_cond_init(&frame_pushed, NULL);
+    pthread_cond_init(&frame_popped, NULL);
+}
+
+// Frames still queued go back to their pool
+DisplayQueue::~DisplayQueue() {
+    DisplayFrame display;
+    close();
+    while(pop(&display)) {
+        display.frame->pool->release(display.frame);
+    }
+
+    pthread_cond_destroy(&frame_popped);
+    pthread_cond_destroy(&frame_pushed);
+    pthread_mutex_destroy(&mutex);
+
+    free(frames);
+}
+
+bool DisplayQueue::push(DisplayFrame display) {
+    pthread_mutex_lock(&mutex);
+    while(filled == capacity && !closed) {
+        pthread_cond_wait(&frame_popped, &mutex);
+    }
+
+    if(closed) {
+        pthread_mutex_unlock(&mutex);
+        return false;
+    }
+
+    frames[write_index] = display;
+    write_index = (write_index + 1) % capacity;
+    filled++;
+
+    pthread_cond_signal(&frame_pushed);
+    pthread_mutex_unlock(&mutex);
+    return true;
+}
+
+bool DisplayQueue::pop(DisplayFrame *display) {
+    pthread_mutex_lock(&mutex);
+    while(filled == 0 && !closed) {
+        pthread_cond_wait(&frame_pushed, &mutex);
+    }
+
+    if(filled == 0) {
+        pthread_mutex_unlock(&mutex);
+        return false;
+    }
+
+    *display = frames[read_index];
+    read_index = (read_index + 1) % capacity;
+    filled--;
+
+    pthread_cond_signal(&frame_popped);
+    pthread_mutex_unlock(&mutex);
+    return true;
+}
+
+void DisplayQueue::close() {
+    pthread_mutex_lock(&mutex);
+    closed = true;
+    pthread_cond_broadcast(&frame_pushed);
+    pthread_cond_broadcast(&frame_popped);
+    pthread_mutex_unlock(&mutex);
+}
+
+bool DisplayQueue::is_closed() {
+    pthread_mutex_lock(&mutex);
+    bool is_closed = closed;
+    pthread_mutex_unlock(&mutex);
+    return is_closed;
+}
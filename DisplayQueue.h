@@ -0,0 +1,54 @@
+#pragma once
+
+#include "FramePool.h"
+
+#include <pthread.h>
+
+// Frames the decoder may have decoded ahead of the one being shown. With the
+// reference pictures and the picture being decoded this bounds the frames
+// of the pool.
+#define DISPLAY_QUEUE_SIZE                  4
+
+// A decoded picture on its way to the display, which releases the frame
+// (frame->pool->release) once it's shown. Every frame has a PTS, the ones of
+// pictures without one are interpolated at the frame rate.
+typedef struct {
+    Frame *frame;
+    double pts;
+} DisplayFrame;
+
+// Hands decoded frames from the decoding thread to the display. The decoder
+// blocks once it is DISPLAY_QUEUE_SIZE frames ahead, the display blocks
+// until there is a frame.
+class DisplayQueue {
+public:
+    DisplayQueue(size_t capacity = DISPLAY_QUEUE_SIZE);
+    ~DisplayQueue();
+
+    // Blocks while the queue is full. Fails once the queue is closed, the
+    // frame is not queued then.
+    bool push(DisplayFrame);
+
+    // Blocks while the queue is empty. Fails once it is closed and empty.
+    bool pop(DisplayFrame*);
+
+    // No more frames are pushed (the decoder is done) or taken (the display
+    // is). Unblocks both sides.
+    void close();
+    bool is_closed();
+
+private:
+    DisplayFrame *frames {nullptr};
+    size_t capacity {0};
+
+    // Frames are pushed at write_index and popped at read_index
+    size_t read_index {0};
+    size_t write_index {0};
+    size_t filled {0};
+
+    bool closed {false};
+
+    pthread_mutex_t mutex;
+    pthread_cond_t frame_pushed;
+    pthread_cond_t frame_popped;
+};
@@ -0,0 +1,95 @@
+#include "FramePool.h"
+
+#include <cstdlib>
+
+FramePool::FramePool() {
+    pthread_mutex_init(&mutex, NULL);
+}
+
+// Held frames have to be released before
+FramePool::~FramePool() {
+    for(Frame *frame : unused) {
+        free_frame(frame);
+    }
+
+    pthread_mutex_destroy(&mutex);
+}
+
+void FramePool::set_size(int width, int height) {
+    pthread_mutex_lock(&mutex);
+
+    if(width != this->width || height != this->height) {
+        for(Frame *frame : unused) {
+            free_frame(frame);
+        }
+        unused.clear();
+
+        this->width = width;
+        this->height = height;
+    }
+
+    pthread_mutex_unlock(&mutex);
+}
+
+Frame *FramePool::acquire() {
+    pthread_mutex_lock(&mutex);
+
+    Frame *frame;
+    if(!unused.empty()) {
+        frame = unused.back();
+        unused.pop_back();
+    } else {
+        frame = (Frame*)malloc(sizeof(Frame));
+        frame->width = width;
+        frame->height = height;
+        frame->stride = (width + 15) & ~15;
+        frame->chroma_stride = frame->stride / 2;
+        frame->coded_height = (height + 15) & ~15;
+
+        size_t plane_size = (size_t)frame->stride*frame->coded_height;
+        size_t chroma_plane_size = (size_t)frame->chroma_stride*(frame->coded_height/2);
+
+        frame->y = (uint8_t*)malloc(sizeof(uint8_t)*plane_size);
+        frame->cb = (uint8_t*)malloc(sizeof(uint8_t)*chroma_plane_size);
+        frame->cr = (uint8_t*)malloc(sizeof(uint8_t)*chroma_plane_size);
+        frame->pool = this;
+
+        nr_of_frames++;
+    }
+
+    frame->pts = -1;
+    frame->references = 1;
+
+    pthread_mutex_unlock(&mutex);
+    return frame;
+}
+
+void FramePool::retain(Frame *frame) {
+    pthread_mutex_lock(&mutex);
+    frame->references++;
+    pthread_mutex_unlock(&mutex);
+}
+
+void FramePool::release(Frame *frame) {
+    pthread_mutex_lock(&mutex);
+
+    frame->references--;
+    if(frame->references == 0) {
+        if(frame->width == width && frame->height == height) {
+            unused.push_back(frame);
+        } else {
+            free_frame(frame);
+        }
+    }
+
+    pthread_mutex_unlock(&mutex);
+}
+
+void FramePool::free_frame(Frame *frame) {
+    free(frame->y);
+    free(frame->cb);
+    free(frame->cr);
+    free(frame);
+
+    nr_of_frames--;
+}
@@ -0,0 +1,61 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include <pthread.h>
+
+class FramePool;
+
+// The planes cover whole macroblocks, y is stride x coded_height. Chroma is
+// stored 4:2:0 like it is coded, cb and cr are chroma_stride x coded_height/2.
+// Only width x height of it is the picture.
+typedef struct {
+    uint8_t *y;
+    uint8_t *cb;
+    uint8_t *cr;
+    int width;
+    int height;
+    int stride;
+    int chroma_stride;
+    int coded_height;
+    // Of the picture decoded into it in seconds, -1 when its packet had none
+    double pts;
+
+    // Holders of the frame, it goes back to its pool when the last one releases it
+    int references;
+    FramePool *pool;
+} Frame;
+
+// Frames of one size, reused instead of allocated for every picture. The
+// decoder holds its reference pictures and the picture being decoded, a
+// frame on its way to the display is held by the display until shown.
+// Frames can be released from any thread.
+class FramePool {
+public:
+    FramePool();
+    ~FramePool();
+
+    // Frames acquired from now on have this size. Frames of the old size that
+    // are still held are freed once released.
+    void set_size(int width, int height);
+
+    // An unused frame (allocated when there is none) with one reference
+    Frame *acquire();
+    void retain(Frame*);
+    void release(Frame*);
+
+    // Frames allocated and not freed, held or not
+    size_t nr_of_frames {0};
+
+private:
+    void free_frame(Frame*);
+
+    int width {0};
+    int height {0};
+
+    std::vector<Frame*> unused;
+
+    pthread_mutex_t mutex;
+};
@@ -0,0 +1,428 @@
+#include "IDCT.h"
+
+#ifdef IDCT_HAS_X86
+#include <immintrin.h>
+#endif
+
+// Both passes multiply by the constants below, scaled by 2^IDCT_CONST_BITS.
+// The first one keeps IDCT_PASS1_BITS of fraction in 16 bits, enough for the
+// IEEE 1180 accuracy limits (see benchmark/idct_benchmark.cpp). Its outputs
+// of real pictures stay well within +-2047, beyond that they saturate, in
+// every kernel the same way. The 32-bit sums of the second pass can't
+// overflow.
+#define IDCT_CONST_BITS                     14
+#define IDCT_PASS1_BITS                     4
+#define IDCT_SHIFT1                         (IDCT_CONST_BITS - IDCT_PASS1_BITS)
+#define IDCT_SHIFT2                         (IDCT_CONST_BITS + IDCT_PASS1_BITS)
+
+// c(k)/2 * cos((2n + 1)k * pi/16) with c(0) = 1/sqrt(2), for the even and the
+// odd k of the outputs n = 0..3. Outputs 7..4 are their even part minus their
+// odd part.
+static const int16_t IDCT_EVEN[4][4] = {
+    {5793,  7568,  5793,  3135},
+    {5793,  3135, -5793, -7568},
+    {5793, -3135, -5793,  7568},
+    {5793, -7568,  5793, -3135}
+};
+
+static const int16_t IDCT_ODD[4][4] = {
+    {8035,  6811,  4551,  1598},
+    {6811, -1598, -8035, -4551},
+    {4551, -8035,  1598,  6811},
+    {1598, -4551,  6811, -8035}
+};
+
+static inline int16_t saturate_int16(int value) {
+    return value > INT16_MAX ? INT16_MAX : value < INT16_MIN ? INT16_MIN : value;
+}
+
+static inline uint8_t saturate_uint8(int value) {
+    return value > 255 ? 255 : value < 0 ? 0 : value;
+}
+
+// The inputs from nr_of_inputs on are 0
+static void idct_1d(const int16_t *in, int in_stride, int16_t *out, int out_stride, int shift, int nr_of_inputs) {
+    int round = 1 << (shift - 1);
+
+    for(int n = 0; n < 4; n++) {
+        int even = 0;
+        int odd = 0;
+        for(int j = 0; j < nr_of_inputs / 2; j++) {
+            even += IDCT_EVEN[n][j] * in[(2 * j) * in_stride];
+            odd += IDCT_ODD[n][j] * in[(2 * j + 1) * in_stride];
+        }
+
+        out[n * out_stride] = saturate_int16((even + odd + round) >> shift);
+        out[(7 - n) * out_stride] = saturate_int16((even - odd + round) >> shift);
+    }
+}
+
+static void store_scalar(const int16_t *result, uint8_t *dest, int stride, bool add) {
+    for(int i = 0; i < 8; i++) {
+        for(int j = 0; j < 8; j++) {
+            int value = result[i * 8 + j];
+            dest[j] = saturate_uint8(add ? dest[j] + value : value);
+        }
+        dest += stride;
+    }
+}
+
+// Columns first, then rows
+void idct_scalar_int16(const int16_t *block, int16_t *result) {
+    int16_t columns[64];
+
+    for(int i = 0; i < 8; i++) {
+        idct_1d(block + i, 8, columns + i, 8, IDCT_SHIFT1, 8);
+    }
+
+    for(int i = 0; i < 8; i++) {
+        idct_1d(columns + i * 8, 1, result + i * 8, 1, IDCT_SHIFT2, 8);
+    }
+}
+
+void idct_scalar(const int16_t *block, uint8_t *dest, int stride, bool add) {
+    int16_t result[64];
+    idct_scalar_int16(block, result);
+
+    store_scalar(result, dest, stride, add);
+}
+
+// Columns 4..7 stay 0 after the first pass
+void idct_4x4_scalar(const int16_t *block, uint8_t *dest, int stride, bool add) {
+    int16_t columns[64] = {0};
+    int16_t result[64];
+
+    for(int i = 0; i < 4; i++) {
+        idct_1d(block + i, 8, columns + i, 8, IDCT_SHIFT1, 4);
+    }
+
+    for(int i = 0; i < 8; i++) {
+        idct_1d(columns + i * 8, 1, result + i * 8, 1, IDCT_SHIFT2, 4);
+    }
+
+    store_scalar(result, dest, stride, add);
+}
+
+// Both passes reduced to the DC constant, rounded like idct_1d does
+static inline int idct_dc_value(int16_t dc) {
+    int column = saturate_int16((IDCT_EVEN[0][0] * dc + (1 << (IDCT_SHIFT1 - 1))) >> IDCT_SHIFT1);
+    return saturate_int16((IDCT_EVEN[0][0] * column + (1 << (IDCT_SHIFT2 - 1))) >> IDCT_SHIFT2);
+}
+
+void idct_dc_scalar(const int16_t *block, uint8_t *dest, int stride, bool add) {
+    int value = idct_dc_value(block[0]);
+
+    for(int i = 0; i < 8; i++) {
+        for(int j = 0; j < 8; j++) {
+            dest[j] = saturate_uint8(add ? dest[j] + value : value);
+        }
+        dest += stride;
+    }
+}
+
+void idct_pair_scalar(const int16_t *blocks, uint8_t *dest, uint8_t *dest2, int stride, bool add) {
+    idct_scalar(blocks, dest, stride, add);
+    idct_scalar(blocks + 64, dest2, stride, add);
+}
+
+#ifdef IDCT_HAS_X86
+
+// Pairs of 16 bit constants for _mm_madd_epi16
+static inline __m128i constant_pair_sse2(int16_t a, int16_t b) {
+    return _mm_set1_epi32((uint16_t)a | ((uint32_t)(uint16_t)b << 16));
+}
+
+// idct_1d on all 8 columns, v[k] is row k. Rows 4..7 are left out when
+// they are known to be 0.
+static inline void idct_pass_sse2(__m128i *v, int shift, int nr_of_inputs) {
+    const __m128i round = _mm_set1_epi32(1 << (shift - 1));
+
+    __m128i rows02_lo = _mm_unpacklo_epi16(v[0], v[2]);
+    __m128i rows02_hi = _mm_unpackhi_epi16(v[0], v[2]);
+    __m128i rows46_lo = _mm_unpacklo_epi16(v[4], v[6]);
+    __m128i rows46_hi = _mm_unpackhi_epi16(v[4], v[6]);
+    __m128i rows13_lo = _mm_unpacklo_epi16(v[1], v[3]);
+    __m128i rows13_hi = _mm_unpackhi_epi16(v[1], v[3]);
+    __m128i rows57_lo = _mm_unpacklo_epi16(v[5], v[7]);
+    __m128i rows57_hi = _mm_unpackhi_epi16(v[5], v[7]);
+
+    for(int n = 0; n < 4; n++) {
+        __m128i even02 = constant_pair_sse2(IDCT_EVEN[n][0], IDCT_EVEN[n][1]);
+        __m128i even46 = constant_pair_sse2(IDCT_EVEN[n][2], IDCT_EVEN[n][3]);
+        __m128i odd13 = constant_pair_sse2(IDCT_ODD[n][0], IDCT_ODD[n][1]);
+        __m128i odd57 = constant_pair_sse2(IDCT_ODD[n][2], IDCT_ODD[n][3]);
+
+        __m128i even_lo = _mm_madd_epi16(rows02_lo, even02);
+        __m128i even_hi = _mm_madd_epi16(rows02_hi, even02);
+        __m128i odd_lo = _mm_madd_epi16(rows13_lo, odd13);
+        __m128i odd_hi = _mm_madd_epi16(rows13_hi, odd13);
+
+        if(nr_of_inputs > 4) {
+            even_lo = _mm_add_epi32(even_lo, _mm_madd_epi16(rows46_lo, even46));
+            even_hi = _mm_add_epi32(even_hi, _mm_madd_epi16(rows46_hi, even46));
+            odd_lo = _mm_add_epi32(odd_lo, _mm_madd_epi16(rows57_lo, odd57));
+            odd_hi = _mm_add_epi32(odd_hi, _mm_madd_epi16(rows57_hi, odd57));
+        }
+
+        even_lo = _mm_add_epi32(even_lo, round);
+        even_hi = _mm_add_epi32(even_hi, round);
+
+        v[n] = _mm_packs_epi32(_mm_srai_epi32(_mm_add_epi32(even_lo, odd_lo), shift),
+                               _mm_srai_epi32(_mm_add_epi32(even_hi, odd_hi), shift));
+        v[7 - n] = _mm_packs_epi32(_mm_srai_epi32(_mm_sub_epi32(even_lo, odd_lo), shift),
+                                   _mm_srai_epi32(_mm_sub_epi32(even_hi, odd_hi), shift));
+    }
+}
+
+static inline void transpose_sse2(__m128i *v) {
+    __m128i a0 = _mm_unpacklo_epi16(v[0], v[1]);
+    __m128i a1 = _mm_unpackhi_epi16(v[0], v[1]);
+    __m128i a2 = _mm_unpacklo_epi16(v[2], v[3]);
+    __m128i a3 = _mm_unpackhi_epi16(v[2], v[3]);
+    __m128i a4 = _mm_unpacklo_epi16(v[4], v[5]);
+    __m128i a5 = _mm_unpackhi_epi16(v[4], v[5]);
+    __m128i a6 = _mm_unpacklo_epi16(v[6], v[7]);
+    __m128i a7 = _mm_unpackhi_epi16(v[6], v[7]);
+
+    __m128i b0 = _mm_unpacklo_epi32(a0, a2);
+    __m128i b1 = _mm_unpackhi_epi32(a0, a2);
+    __m128i b2 = _mm_unpacklo_epi32(a1, a3);
+    __m128i b3 = _mm_unpackhi_epi32(a1, a3);
+    __m128i b4 = _mm_unpacklo_epi32(a4, a6);
+    __m128i b5 = _mm_unpackhi_epi32(a4, a6);
+    __m128i b6 = _mm_unpacklo_epi32(a5, a7);
+    __m128i b7 = _mm_unpackhi_epi32(a5, a7);
+
+    v[0] = _mm_unpacklo_epi64(b0, b4);
+    v[1] = _mm_unpackhi_epi64(b0, b4);
+    v[2] = _mm_unpacklo_epi64(b1, b5);
+    v[3] = _mm_unpackhi_epi64(b1, b5);
+    v[4] = _mm_unpacklo_epi64(b2, b6);
+    v[5] = _mm_unpackhi_epi64(b2, b6);
+    v[6] = _mm_unpacklo_epi64(b3, b7);
+    v[7] = _mm_unpackhi_epi64(b3, b7);
+}
+
+static inline void store_sse2(const __m128i *v, uint8_t *dest, int stride, bool add) {
+    const __m128i zero = _mm_setzero_si128();
+    for(int i = 0; i < 8; i++) {
+        __m128i row = v[i];
+        if(add) {
+            __m128i prediction = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i*)dest), zero);
+            row = _mm_adds_epi16(row, prediction);
+        }
+
+        _mm_storel_epi64((__m128i*)dest, _mm_packus_epi16(row, row));
+        dest += stride;
+    }
+}
+
+void idct_sse2(const int16_t *block, uint8_t *dest, int stride, bool add) {
+    __m128i v[8];
+    for(int i = 0; i < 8; i++) {
+        v[i] = _mm_loadu_si128((const __m128i*)(block + i * 8));
+    }
+
+    idct_pass_sse2(v, IDCT_SHIFT1, 8);
+    transpose_sse2(v);
+    idct_pass_sse2(v, IDCT_SHIFT2, 8);
+    transpose_sse2(v);
+
+    store_sse2(v, dest, stride, add);
+}
+
+// Rows 4..7 of the block are 0, and so are rows 4..7 of the transposed
+// first pass
+void idct_4x4_sse2(const int16_t *block, uint8_t *dest, int stride, bool add) {
+    __m128i v[8];
+    for(int i = 0; i < 4; i++) {
+        v[i] = _mm_loadu_si128((const __m128i*)(block + i * 8));
+        v[i + 4] = _mm_setzero_si128();
+    }
+
+    idct_pass_sse2(v, IDCT_SHIFT1, 4);
+    transpose_sse2(v);
+    idct_pass_sse2(v, IDCT_SHIFT2, 4);
+    transpose_sse2(v);
+
+    store_sse2(v, dest, stride, add);
+}
+
+void idct_pair_sse2(const int16_t *blocks, uint8_t *dest, uint8_t *dest2, int stride, bool add) {
+    idct_sse2(blocks, dest, stride, add);
+    idct_sse2(blocks + 64, dest2, stride, add);
+}
+
+void idct_dc_sse2(const int16_t *block, uint8_t *dest, int stride, bool add) {
+    __m128i value = _mm_set1_epi16(idct_dc_value(block[0]));
+
+    __m128i v[8];
+    for(int i = 0; i < 8; i++) {
+        v[i] = value;
+    }
+
+    store_sse2(v, dest, stride, add);
+}
+
+// The SSE2 kernel on 256 bit registers, the instructions it uses all work
+// within 128-bit lanes
+__attribute__((target("avx2")))
+static inline __m256i constant_pair_avx2(int16_t a, int16_t b) {
+    return _mm256_set1_epi32((uint16_t)a | ((uint32_t)(uint16_t)b << 16));
+}
+
+__attribute__((target("avx2")))
+static inline void idct_pass_avx2(__m256i *v, int shift) {
+    const __m256i round = _mm256_set1_epi32(1 << (shift - 1));
+
+    __m256i rows02_lo = _mm256_unpacklo_epi16(v[0], v[2]);
+    __m256i rows02_hi = _mm256_unpackhi_epi16(v[0], v[2]);
+    __m256i rows46_lo = _mm256_unpacklo_epi16(v[4], v[6]);
+    __m256i rows46_hi = _mm256_unpackhi_epi16(v[4], v[6]);
+    __m256i rows13_lo = _mm256_unpacklo_epi16(v[1], v[3]);
+    __m256i rows13_hi = _mm256_unpackhi_epi16(v[1], v[3]);
+    __m256i rows57_lo = _mm256_unpacklo_epi16(v[5], v[7]);
+    __m256i rows57_hi = _mm256_unpackhi_epi16(v[5], v[7]);
+
+    for(int n = 0; n < 4; n++) {
+        __m256i even02 = constant_pair_avx2(IDCT_EVEN[n][0], IDCT_EVEN[n][1]);
+        __m256i even46 = constant_pair_avx2(IDCT_EVEN[n][2], IDCT_EVEN[n][3]);
+        __m256i odd13 = constant_pair_avx2(IDCT_ODD[n][0], IDCT_ODD[n][1]);
+        __m256i odd57 = constant_pair_avx2(IDCT_ODD[n][2], IDCT_ODD[n][3]);
+
+        __m256i even_lo = _mm256_add_epi32(_mm256_madd_epi16(rows02_lo, even02), _mm256_madd_epi16(rows46_lo, even46));
+        __m256i even_hi = _mm256_add_epi32(_mm256_madd_epi16(rows02_hi, even02), _mm256_madd_epi16(rows46_hi, even46));
+        __m256i odd_lo = _mm256_add_epi32(_mm256_madd_epi16(rows13_lo, odd13), _mm256_madd_epi16(rows57_lo, odd57));
+        __m256i odd_hi = _mm256_add_epi32(_mm256_madd_epi16(rows13_hi, odd13), _mm256_madd_epi16(rows57_hi, odd57));
+
+        even_lo = _mm256_add_epi32(even_lo, round);
+        even_hi = _mm256_add_epi32(even_hi, round);
+
+        v[n] = _mm256_packs_epi32(_mm256_srai_epi32(_mm256_add_epi32(even_lo, odd_lo), shift),
+                                  _mm256_srai_epi32(_mm256_add_epi32(even_hi, odd_hi), shift));
+        v[7 - n] = _mm256_packs_epi32(_mm256_srai_epi32(_mm256_sub_epi32(even_lo, odd_lo), shift),
+                                      _mm256_srai_epi32(_mm256_sub_epi32(even_hi, odd_hi), shift));
+    }
+}
+
+__attribute__((target("avx2")))
+static inline void transpose_avx2(__m256i *v) {
+    __m256i a0 = _mm256_unpacklo_epi16(v[0], v[1]);
+    __m256i a1 = _mm256_unpackhi_epi16(v[0], v[1]);
+    __m256i a2 = _mm256_unpacklo_epi16(v[2], v[3]);
+    __m256i a3 = _mm256_unpackhi_epi16(v[2], v[3]);
+    __m256i a4 = _mm256_unpacklo_epi16(v[4], v[5]);
+    __m256i a5 = _mm256_unpackhi_epi16(v[4], v[5]);
+    __m256i a6 = _mm256_unpacklo_epi16(v[6], v[7]);
+    __m256i a7 = _mm256_unpackhi_epi16(v[6], v[7]);
+
+    __m256i b0 = _mm256_unpacklo_epi32(a0, a2);
+    __m256i b1 = _mm256_unpackhi_epi32(a0, a2);
+    __m256i b2 = _mm256_unpacklo_epi32(a1, a3);
+    __m256i b3 = _mm256_unpackhi_epi32(a1, a3);
+    __m256i b4 = _mm256_unpacklo_epi32(a4, a6);
+    __m256i b5 = _mm256_unpackhi_epi32(a4, a6);
+    __m256i b6 = _mm256_unpacklo_epi32(a5, a7);
+    __m256i b7 = _mm256_unpackhi_epi32(a5, a7);
+
+    v[0] = _mm256_unpacklo_epi64(b0, b4);
+    v[1] = _mm256_unpackhi_epi64(b0, b4);
+    v[2] = _mm256_unpacklo_epi64(b1, b5);
+    v[3] = _mm256_unpackhi_epi64(b1, b5);
+    v[4] = _mm256_unpacklo_epi64(b2, b6);
+    v[5] = _mm256_unpackhi_epi64(b2, b6);
+    v[6] = _mm256_unpacklo_epi64(b3, b7);
+    v[7] = _mm256_unpackhi_epi64(b3, b7);
+}
+
+__attribute__((target("avx2")))
+void idct_pair_avx2(const int16_t *blocks, uint8_t *dest, uint8_t *dest2, int stride, bool add) {
+    __m256i v[8];
+    for(int i = 0; i < 8; i++) {
+        __m128i row = _mm_loadu_si128((const __m128i*)(blocks + i * 8));
+        __m128i row2 = _mm_loadu_si128((const __m128i*)(blocks + 64 + i * 8));
+        v[i] = _mm256_inserti128_si256(_mm256_castsi128_si256(row), row2, 1);
+    }
+
+    idct_pass_avx2(v, IDCT_SHIFT1);
+    transpose_avx2(v);
+    idct_pass_avx2(v, IDCT_SHIFT2);
+    transpose_avx2(v);
+
+    const __m256i zero = _mm256_setzero_si256();
+    for(int i = 0; i < 8; i++) {
+        __m256i row = v[i];
+        if(add) {
+            __m128i prediction = _mm_loadl_epi64((const __m128i*)dest);
+            __m128i prediction2 = _mm_loadl_epi64((const __m128i*)dest2);
+            __m256i predictions = _mm256_inserti128_si256(_mm256_castsi128_si256(prediction), prediction2, 1);
+            row = _mm256_adds_epi16(row, _mm256_unpacklo_epi8(predictions, zero));
+        }
+
+        __m256i pixels = _mm256_packus_epi16(row, row);
+        _mm_storel_epi64((__m128i*)dest, _mm256_castsi256_si128(pixels));
+        _mm_storel_epi64((__m128i*)dest2, _mm256_extracti128_si256(pixels, 1));
+        dest += stride;
+        dest2 += stride;
+    }
+}
+
+bool idct_has_avx2() {
+    return __builtin_cpu_supports("avx2");
+}
+
+static idct_kernel select_kernel() {
+    return idct_sse2;
+}
+
+static idct_kernel select_4x4_kernel() {
+    return idct_4x4_sse2;
+}
+
+static idct_kernel select_dc_kernel() {
+    return idct_dc_sse2;
+}
+
+static idct_pair_kernel select_pair_kernel() {
+    return idct_has_avx2() ? idct_pair_avx2 : idct_pair_sse2;
+}
+
+#else
+
+static idct_kernel select_kernel() {
+    return idct_scalar;
+}
+
+static idct_kernel select_4x4_kernel() {
+    return idct_4x4_scalar;
+}
+
+static idct_kernel select_dc_kernel() {
+    return idct_dc_scalar;
+}
+
+static idct_pair_kernel select_pair_kernel() {
+    return idct_pair_scalar;
+}
+
+#endif
+
+void idct(const int16_t *block, uint8_t *dest, int stride, bool add) {
+    static const idct_kernel kernel = select_kernel();
+    kernel(block, dest, stride, add);
+}
+
+void idct_dc(const int16_t *block, uint8_t *dest, int stride, bool add) {
+    static const idct_kernel kernel = select_dc_kernel();
+    kernel(block, dest, stride, add);
+}
+
+void idct_4x4(const int16_t *block, uint8_t *dest, int stride, bool add) {
+    static const idct_kernel kernel = select_4x4_kernel();
+    kernel(block, dest, stride, add);
+}
+
+void idct_pair(const int16_t *blocks, uint8_t *dest, uint8_t *dest2, int stride, bool add) {
+    static const idct_pair_kernel kernel = select_pair_kernel();
+    kernel(blocks, dest, dest2, stride, add);
+}
@@ -0,0 +1,51 @@
+#pragma once
+
+#include <cstdint>
+
+// 8x8 integer inverse DCT with the clamp to 0..255 fused into the output
+//
+// A block holds dequantized coefficients (-2048..2047) in raster order. The
+// transform of an intra block is put into dest, the one of any other block is
+// a residual that is added to the prediction already in dest. The result is
+// saturated to 0..255 either way. Every kernel gives exactly the result of
+// the scalar one, which is the reference.
+
+typedef void (*idct_kernel)(const int16_t *block, uint8_t *dest, int stride, bool add);
+
+// Transforms two consecutive blocks (block and block + 64), the second one into dest2
+typedef void (*idct_pair_kernel)(const int16_t *blocks, uint8_t *dest, uint8_t *dest2, int stride, bool add);
+
+// Coefficients of the top left 4x4 (raster order), for idct_4x4
+#define IDCT_TOP_LEFT_4X4                   0x0F0F0F0FULL
+
+void idct(const int16_t *block, uint8_t *dest, int stride, bool add);
+void idct_pair(const int16_t *blocks, uint8_t *dest, uint8_t *dest2, int stride, bool add);
+
+// Sparse blocks, with the same result as the full transform: one with only a
+// DC coefficient is a constant, one with nothing outside the top left 4x4
+// skips the multiplications by the zeros.
+void idct_dc(const int16_t *block, uint8_t *dest, int stride, bool add);
+void idct_4x4(const int16_t *block, uint8_t *dest, int stride, bool add);
+
+void idct_scalar(const int16_t *block, uint8_t *dest, int stride, bool add);
+void idct_pair_scalar(const int16_t *blocks, uint8_t *dest, uint8_t *dest2, int stride, bool add);
+void idct_4x4_scalar(const int16_t *block, uint8_t *dest, int stride, bool add);
+void idct_dc_scalar(const int16_t *block, uint8_t *dest, int stride, bool add);
+
+// The transform of the scalar kernel before it is saturated to 0..255, to
+// check its accuracy (benchmark/idct_benchmark.cpp)
+void idct_scalar_int16(const int16_t *block, int16_t *result);
+
+#if defined(__x86_64__) || defined(__i386__)
+#define IDCT_HAS_X86
+
+void idct_sse2(const int16_t *block, uint8_t *dest, int stride, bool add);
+void idct_pair_sse2(const int16_t *blocks, uint8_t *dest, uint8_t *dest2, int stride, bool add);
+void idct_4x4_sse2(const int16_t *block, uint8_t *dest, int stride, bool add);
+void idct_dc_sse2(const int16_t *block, uint8_t *dest, int stride, bool add);
+
+// Both blocks at once, one in each 128-bit lane
+void idct_pair_avx2(const int16_t *blocks, uint8_t *dest, uint8_t *dest2, int stride, bool add);
+
+bool idct_has_avx2();
+#endif
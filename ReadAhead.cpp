@@ -0,0 +1,193 @@
+#include "ReadAhead.h"
+
+#include <chrono>
+#include <cstring>
+
+ReadAhead::ReadAhead(ByteSource *source, size_t read_ahead_size, size_t chunk_size) {
+    this->source = source;
+    this->chunk_size = chunk_size;
+
+    // At least double buffered, so one chunk can be read while the next fills
+    nr_of_chunks = read_ahead_size / chunk_size;
+    if(nr_of_chunks < 2) {
+        nr_of_chunks = 2;
+    }
+
+    chunks = (Chunk*)malloc(nr_of_chunks * sizeof(Chunk));
+    for(size_t i = 0; i < nr_of_chunks; i++) {
+        chunks[i].data = (uint8_t*)malloc(chunk_size * sizeof(uint8_t));
+        chunks[i].size = 0;
+        chunks[i].position = 0;
+    }
+
+    pthread_mutex_init(&mutex, NULL);
+    pthread_cond_init(&chunk_filled, NULL);
+    pthread_cond_init(&chunk_emptied, NULL);
+
+    start_thread();
+}
+
+ReadAhead::~ReadAhead() {
+    stop_thread();
+
+    pthread_cond_destroy(&chunk_emptied);
+    pthread_cond_destroy(&chunk_filled);
+    pthread_mutex_destroy(&mutex);
+
+    for(size_t i = 0; i < nr_of_chunks; i++) {
+        free(chunks[i].data);
+    }
+    free(chunks);
+}
+
+void ReadAhead::start_thread() {
+    stop = false;
+    pthread_create(&thread, NULL, read_thread, (void*)this);
+}
+
+void ReadAhead::stop_thread() {
+    pthread_mutex_lock(&mutex);
+    stop = true;
+    pthread_cond_signal(&chunk_emptied);
+    pthread_mutex_unlock(&mutex);
+
+    pthread_join(thread, NULL);
+}
+
+// The I/O thread is stopped while the source moves, everything it read
+// ahead belongs to the old position
+bool ReadAhead::seek(size_t position) {
+    stop_thread();
+
+    bool seeked = source->seek(position);
+
+    read_index = 0;
+    write_index = 0;
+    filled = 0;
+    has_ended = false;
+
+    start_thread();
+    return seeked;
+}
+
+// The filled chunks are moved to the front of the larger ring, in order
+void ReadAhead::grow(size_t read_ahead_size) {
+    size_t grown_nr_of_chunks = read_ahead_size / chunk_size;
+    if(grown_nr_of_chunks <= nr_of_chunks) {
+        return;
+    }
+
+    stop_thread();
+
+    Chunk *grown = (Chunk*)malloc(grown_nr_of_chunks * sizeof(Chunk));
+    for(size_t i = 0; i < nr_of_chunks; i++) {
+        grown[i] = chunks[(read_index + i) % nr_of_chunks];
+    }
+
+    for(size_t i = nr_of_chunks; i < grown_nr_of_chunks; i++) {
+        grown[i].data = (uint8_t*)malloc(chunk_size * sizeof(uint8_t));
+        grown[i].size = 0;
+        grown[i].position = 0;
+    }
+
+    free(chunks);
+    chunks = grown;
+    nr_of_chunks = grown_nr_of_chunks;
+
+    read_index = 0;
+    write_index = filled;
+
+    start_thread();
+}
+
+void* ReadAhead::read_thread(void *args) {
+    ((ReadAhead*)args)->fill_chunks();
+    return NULL;
+}
+
+void ReadAhead::fill_chunks() {
+    while(true) {
+        pthread_mutex_lock(&mutex);
+        while(filled == nr_of_chunks && !stop) {
+            pthread_cond_wait(&chunk_emptied, &mutex);
+        }
+
+        if(stop) {
+            pthread_mutex_unlock(&mutex);
+            return;
+        }
+
+        // The chunk at write_index isn't visible to the consumer until filled
+        // is increased, so it can be read into without holding the lock
+        Chunk *chunk = &chunks[write_index];
+        pthread_mutex_unlock(&mutex);
+
+        size_t read = source->read(chunk->data, chunk_size);
+
+        pthread_mutex_lock(&mutex);
+        if(read == 0) {
+            has_ended = true;
+        } else {
+            chunk->size = read;
+            chunk->position = 0;
+
+            write_index = (write_index + 1) % nr_of_chunks;
+            filled++;
+        }
+
+        pthread_cond_signal(&chunk_filled);
+        pthread_mutex_unlock(&mutex);
+
+        if(read == 0) {
+            return;
+        }
+    }
+}
+
+// Copies up to size bytes into destination, blocking until the I/O thread has
+// data. Returns 0 once the whole file has been read.
+size_t ReadAhead::read(uint8_t *destination, size_t size) {
+    using std::chrono::high_resolution_clock;
+    using std::chrono::duration;
+
+    pthread_mutex_lock(&mutex);
+    if(filled == 0 && !has_ended) {
+        auto t1 = high_resolution_clock::now();
+        while(filled == 0 && !has_ended) {
+            pthread_cond_wait(&chunk_filled, &mutex);
+        }
+        auto t2 = high_resolution_clock::now();
+
+        duration<double> waited = t2 - t1;
+        wait_time += waited.count();
+        nr_of_waits++;
+    }
+
+    if(filled == 0) {
+        pthread_mutex_unlock(&mutex);
+        return 0;
+    }
+
+    // Filled chunks are left alone by the I/O thread
+    Chunk *chunk = &chunks[read_index];
+    pthread_mutex_unlock(&mutex);
+
+    size_t copied = chunk->size - chunk->position;
+    if(copied > size) {
+        copied = size;
+    }
+
+    memcpy(destination, chunk->data + chunk->position, copied);
+    chunk->position += copied;
+    total_read += copied;
+
+    if(chunk->position == chunk->size) {
+        pthread_mutex_lock(&mutex);
+        read_index = (read_index + 1) % nr_of_chunks;
+        filled--;
+        pthread_cond_signal(&chunk_emptied);
+        pthread_mutex_unlock(&mutex);
+    }
+
+    return copied;
+}
@@ -0,0 +1,59 @@
+#include "ByteSource.h"
+
+#include <pthread.h>
+
+// Reads another source on a separate thread, keeping a number of chunks
+// filled ahead of the consumer so reads on the decoding thread rarely block
+// on I/O.
+class ReadAhead : public ByteSource {
+public:
+    ReadAhead(ByteSource*, size_t read_ahead_size, size_t chunk_size);
+    ~ReadAhead();
+
+    size_t read(uint8_t*, size_t) override;
+
+    // Drops the chunks read ahead and continues at position
+    bool seek(size_t) override;
+    bool is_seekable() override { return source->is_seekable(); }
+
+    // Adds chunks until read_ahead_size bytes can be read ahead
+    void grow(size_t read_ahead_size);
+
+    // Time the consumer spent waiting for the I/O thread, in seconds
+    double wait_time {0.0};
+    size_t nr_of_waits {0};
+
+    size_t total_read {0};
+
+private:
+    static void* read_thread(void*);
+    void fill_chunks();
+    void start_thread();
+    void stop_thread();
+
+    typedef struct {
+        uint8_t *data;
+        size_t size;
+        size_t position;
+    } Chunk;
+
+    ByteSource *source {nullptr};
+
+    Chunk *chunks {nullptr};
+    size_t nr_of_chunks {0};
+    size_t chunk_size {0};
+
+    // Chunks are filled at write_index and read at read_index, filled counts
+    // the chunks in between that are ready to be read
+    size_t read_index {0};
+    size_t write_index {0};
+    size_t filled {0};
+
+    bool has_ended {false};
+    bool stop {false};
+
+    pthread_t thread;
+    pthread_mutex_t mutex;
+    pthread_cond_t chunk_filled;
+    pthread_cond_t chunk_emptied;
+};
@@ -0,0 +1,280 @@
+#include "SeekIndex.h"
+#include "Demuxer.h"
+
+#include <cstring>
+#include <string>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define PICTURE_START_CODE                  0x00
+#define SEQUENCE_HEADER_START_CODE          0xB3
+#define GROUP_START_CODE                    0xB8
+
+#define PICTURE_TYPE_I                      1
+
+// FRAME_RATE of VideoDecoder.h, which can't be included without OpenCV
+static const double SEEK_INDEX_FRAME_RATE[16] = {
+    0, 23.976, 24, 25, 29.97, 30, 50, 59.94, 60
+};
+
+static bool file_header(const char*, SeekIndexHeader*);
+static double time_code_seconds(uint32_t, double);
+static void set_times(std::vector<SeekIndexEntry>&);
+
+SeekIndex::~SeekIndex() {
+    clear();
+}
+
+void SeekIndex::clear() {
+    if(mapping) {
+        munmap(mapping, mapped_size);
+        mapping = nullptr;
+        mapped_size = 0;
+    }
+
+    built.clear();
+    header = {};
+    entries = nullptr;
+    nr_of_entries = 0;
+}
+
+bool SeekIndex::open(const char *file) {
+    std::string path = std::string(file) + SEEK_INDEX_SUFFIX;
+    if(load(path.c_str(), file)) {
+        return true;
+    }
+
+    if(!build(file)) {
+        return false;
+    }
+
+    // An index that can't be saved (a read only directory) still works for this run
+    save(path.c_str());
+    return true;
+}
+
+bool SeekIndex::build(const char *file) {
+    clear();
+
+    FileSource source(file);
+    if(!source.is_open() || !file_header(file, &header)) {
+        return false;
+    }
+
+    Demuxer demuxer(&source);
+    demuxer.audio_stream_id = DEMUXER_NO_STREAM;
+    demuxer.track_video_packets = true;
+
+    BitStream *stream = demuxer.video_stream;
+
+    uint64_t sequence_offset = 0;
+    double frame_rate = 0;
+    uint32_t time_code = 0;
+    bool closed_gop = false;
+    bool broken_link = false;
+
+    // The GOP entry that gets the PTS of the next picture
+    long pending_gop = -1;
+
+    // A PTS belongs to the first picture that starts in its packet
+    uint64_t pts_used_offset = (uint64_t)-1;
+
+    stream->next_start_code();
+    while(stream->start_code != -1) {
+        const MPEG1_PacketPosition *packet = demuxer.video_packet_at(stream->position() - 4);
+        uint64_t offset = packet ? packet->offset : 0;
+
+        if(stream->start_code == SEQUENCE_HEADER_START_CODE) {
+            sequence_offset = offset;
+
+            // Width, height and aspect ratio
+            stream->skip(28);
+            frame_rate = SEEK_INDEX_FRAME_RATE[stream->consume(4) & 0x0F];
+        } else if(stream->start_code == GROUP_START_CODE) {
+            time_code = stream->consume(25);
+            closed_gop = stream->consume(1);
+            broken_link = stream->consume(1);
+
+            pending_gop = built.size();
+            // Until set_times() the time is that of the time code
+            built.push_back({offset, sequence_offset, -1, time_code_seconds(time_code, frame_rate),
+                             time_code, SEEK_INDEX_GOP, closed_gop, broken_link, 0});
+        } else if(stream->start_code == PICTURE_START_CODE) {
+            // Temporal reference
+            stream->skip(10);
+            int picture_coding_type = stream->consume(3);
+
+            double pts = -1;
+            if(packet && packet->pts >= 0 && packet->offset != pts_used_offset) {
+                pts = packet->pts;
+                pts_used_offset = packet->offset;
+            }
+
+            if(pending_gop >= 0) {
+                built[pending_gop].pts = pts;
+                pending_gop = -1;
+            }
+
+            if(picture_coding_type == PICTURE_TYPE_I) {
+                built.push_back({offset, sequence_offset, pts, time_code_seconds(time_code, frame_rate),
+                                 time_code, SEEK_INDEX_I_PICTURE, closed_gop, broken_link, 0});
+            }
+        }
+
+        stream->next_start_code();
+    }
+
+    set_times(built);
+
+    entries = built.data();
+    nr_of_entries = built.size();
+    return true;
+}
+
+// Drop frame flag, hours, minutes, marker bit, seconds and pictures
+static double time_code_seconds(uint32_t time_code, double frame_rate) {
+    double seconds = ((time_code >> 19) & 0x1F) * 3600 +
+                     ((time_code >> 13) & 0x3F) * 60 +
+                     ((time_code >> 6) & 0x3F);
+
+    if(frame_rate > 0) {
+        seconds += (time_code & 0x3F) / frame_rate;
+    }
+
+    return seconds;
+}
+
+// Turns the time code times into times from the first entry. An entry with
+// a PTS is timed from the last one that had a PTS, one without is timed by
+// the time codes from there.
+static void set_times(std::vector<SeekIndexEntry> &entries) {
+    if(entries.empty()) {
+        return;
+    }
+
+    double first_time_code = entries[0].time;
+
+    const SeekIndexEntry *reference = nullptr;
+    double reference_time_code = 0;
+
+    for(auto &entry : entries) {
+        double time_code = entry.time;
+
+        if(!reference) {
+            entry.time = time_code - first_time_code;
+        } else if(entry.pts >= 0) {
+            entry.time = reference->time + (entry.pts - reference->pts);
+        } else {
+            entry.time = reference->time + (time_code - reference_time_code);
+        }
+
+        if(entry.pts >= 0) {
+            reference = &entry;
+            reference_time_code = time_code;
+        }
+    }
+}
+
+const SeekIndexEntry* SeekIndex::find(double seconds) {
+    const SeekIndexEntry *found = nullptr;
+
+    for(size_t i = 0; i < nr_of_entries; i++) {
+        if(entries[i].type != SEEK_INDEX_GOP) {
+            continue;
+        }
+
+        if(found && entries[i].time > seconds) {
+            break;
+        }
+
+        found = &entries[i];
+    }
+
+    return found;
+}
+
+// The header a sidecar of file has to have, apart from the number of entries
+static bool file_header(const char *file, SeekIndexHeader *header) {
+    struct stat file_stat;
+    if(stat(file, &file_stat) != 0) {
+        return false;
+    }
+
+    memset(header, 0, sizeof(SeekIndexHeader));
+    memcpy(header->magic, SEEK_INDEX_MAGIC, sizeof(SEEK_INDEX_MAGIC));
+    header->version = SEEK_INDEX_VERSION;
+    header->file_size = file_stat.st_size;
+    header->file_mtime = (int64_t)file_stat.st_mtim.tv_sec * 1000000000 + file_stat.st_mtim.tv_nsec;
+    return true;
+}
+
+// Written next to the sidecar and renamed over it, a reader never sees half of one
+bool SeekIndex::save(const char *path) {
+    if(!header.version) {
+        return false;
+    }
+
+    std::string temporary_path = std::string(path) + ".tmp";
+    FILE *fp = fopen(temporary_path.c_str(), "wb");
+    if(!fp) {
+        return false;
+    }
+
+    header.nr_of_entries = nr_of_entries;
+
+    bool written = fwrite(&header, sizeof(SeekIndexHeader), 1, fp) == 1 &&
+                   fwrite(entries, sizeof(SeekIndexEntry), nr_of_entries, fp) == nr_of_entries;
+
+    if(fclose(fp) != 0 || !written || rename(temporary_path.c_str(), path) != 0) {
+        unlink(temporary_path.c_str());
+        return false;
+    }
+
+    return true;
+}
+
+bool SeekIndex::load(const char *path, const char *file) {
+    clear();
+
+    SeekIndexHeader expected;
+    if(!file_header(file, &expected)) {
+        return false;
+    }
+
+    FILE *fp = fopen(path, "rb");
+    if(!fp) {
+        return false;
+    }
+
+    struct stat sidecar_stat;
+    if(fstat(fileno(fp), &sidecar_stat) != 0 || (size_t)sidecar_stat.st_size < sizeof(SeekIndexHeader)) {
+        fclose(fp);
+        return false;
+    }
+
+    size_t size = sidecar_stat.st_size;
+    void *data = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fileno(fp), 0);
+    fclose(fp);
+
+    if(data == MAP_FAILED) {
+        return false;
+    }
+
+    const SeekIndexHeader *loaded = (const SeekIndexHeader*)data;
+    expected.nr_of_entries = loaded->nr_of_entries;
+
+    if(memcmp(loaded, &expected, sizeof(SeekIndexHeader)) != 0 ||
+            size != sizeof(SeekIndexHeader) + (size_t)loaded->nr_of_entries * sizeof(SeekIndexEntry)) {
+        munmap(data, size);
+        return false;
+    }
+
+    mapping = data;
+    mapped_size = size;
+    header = expected;
+
+    entries = (const SeekIndexEntry*)((const uint8_t*)data + sizeof(SeekIndexHeader));
+    nr_of_entries = loaded->nr_of_entries;
+    return true;
+}
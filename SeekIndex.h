@@ -0,0 +1,82 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// A sidecar file next to the video (video.mpg.idx) with the position of every
+// GOP and I-picture. It is a SeekIndexHeader followed by the entries, in host
+// byte order, and is mapped as is. The version doubles as a byte order check.
+#define SEEK_INDEX_MAGIC                    "MPG1IDX"
+#define SEEK_INDEX_VERSION                  2
+#define SEEK_INDEX_SUFFIX                   ".idx"
+
+#define SEEK_INDEX_GOP                      1
+#define SEEK_INDEX_I_PICTURE                2
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t nr_of_entries;
+    // Of the indexed file, a sidecar that doesn't match is stale
+    uint64_t file_size;
+    // Nanoseconds
+    int64_t file_mtime;
+} SeekIndexHeader;
+
+typedef struct {
+    // File offset of the packet the start code begins in, demuxing can
+    // restart there
+    uint64_t offset;
+    // Same for the last sequence header before it
+    uint64_t sequence_offset;
+    // Seconds, -1 when the picture (for a GOP its first picture) has no PTS
+    double pts;
+    // Seconds from the first GOP. Follows the PTS, bridged by the time codes
+    // where there is none.
+    double time;
+    // Of the GOP (an I-picture is part of), 25 bits as in the GOP header
+    uint32_t time_code;
+    uint8_t type;
+    uint8_t closed_gop;
+    uint8_t broken_link;
+    uint8_t reserved;
+} SeekIndexEntry;
+
+static_assert(sizeof(SeekIndexHeader) == 32, "SeekIndexHeader is part of the file format");
+static_assert(sizeof(SeekIndexEntry) == 40, "SeekIndexEntry is part of the file format");
+
+class SeekIndex {
+public:
+    ~SeekIndex();
+
+    // Loads the sidecar of file, building (and saving) it when it is missing
+    // or stale
+    bool open(const char *file);
+
+    // Indexes file in one pass over its video
+    bool build(const char *file);
+    bool save(const char *path);
+    // Maps the sidecar at path, fails when it doesn't belong to file
+    bool load(const char *path, const char *file);
+
+    // The last GOP at or before seconds (from the first GOP), the first GOP
+    // when seconds is before it. nullptr without GOPs.
+    const SeekIndexEntry* find(double seconds);
+
+    const SeekIndexEntry *entries {nullptr};
+    size_t nr_of_entries {0};
+
+private:
+    void clear();
+
+    // Identifies the indexed file, version is 0 while there is no index
+    SeekIndexHeader header {};
+
+    // Entries of a built index
+    std::vector<SeekIndexEntry> built;
+
+    // A loaded sidecar
+    void *mapping {nullptr};
+    size_t mapped_size {0};
+};
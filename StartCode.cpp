@@ -0,0 +1,102 @@
+#include "StartCode.h"
+
+#ifdef START_CODE_HAS_X86
+#include <immintrin.h>
+#endif
+
+const uint8_t* find_start_code_scalar(const uint8_t *begin, const uint8_t *end) {
+    const uint8_t *p = begin;
+
+    // Look at the last byte of every candidate first. Anything above 0x01 rules
+    // out a prefix starting at p, p + 1 and p + 2, so most of the time the
+    // scan moves three bytes per step.
+    while(end - p >= 3) {
+        if(p[2] > 0x01) {
+            p += 3;
+        } else if(p[2] == 0x01) {
+            if(p[0] == 0x00 && p[1] == 0x00) {
+                return p;
+            }
+            p += 3;
+        } else {
+            p++;
+        }
+    }
+
+    return end;
+}
+
+#ifdef START_CODE_HAS_X86
+
+const uint8_t* find_start_code_sse2(const uint8_t *begin, const uint8_t *end) {
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i one = _mm_set1_epi8(1);
+    const uint8_t *p = begin;
+
+    // 16 candidate positions per step, each one needs the two bytes after it
+    while(end - p >= 16 + 2) {
+        __m128i b0 = _mm_loadu_si128((const __m128i*)p);
+        __m128i b1 = _mm_loadu_si128((const __m128i*)(p + 1));
+        __m128i b2 = _mm_loadu_si128((const __m128i*)(p + 2));
+
+        __m128i match = _mm_and_si128(_mm_and_si128(_mm_cmpeq_epi8(b0, zero),
+                                                    _mm_cmpeq_epi8(b1, zero)),
+                                      _mm_cmpeq_epi8(b2, one));
+
+        int mask = _mm_movemask_epi8(match);
+        if(mask) {
+            return p + __builtin_ctz(mask);
+        }
+
+        p += 16;
+    }
+
+    return find_start_code_scalar(p, end);
+}
+
+__attribute__((target("avx2")))
+const uint8_t* find_start_code_avx2(const uint8_t *begin, const uint8_t *end) {
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i one = _mm256_set1_epi8(1);
+    const uint8_t *p = begin;
+
+    while(end - p >= 32 + 2) {
+        __m256i b0 = _mm256_loadu_si256((const __m256i*)p);
+        __m256i b1 = _mm256_loadu_si256((const __m256i*)(p + 1));
+        __m256i b2 = _mm256_loadu_si256((const __m256i*)(p + 2));
+
+        __m256i match = _mm256_and_si256(_mm256_and_si256(_mm256_cmpeq_epi8(b0, zero),
+                                                          _mm256_cmpeq_epi8(b1, zero)),
+                                         _mm256_cmpeq_epi8(b2, one));
+
+        unsigned int mask = (unsigned int)_mm256_movemask_epi8(match);
+        if(mask) {
+            return p + __builtin_ctz(mask);
+        }
+
+        p += 32;
+    }
+
+    return find_start_code_sse2(p, end);
+}
+
+bool start_code_has_avx2() {
+    return __builtin_cpu_supports("avx2");
+}
+
+static start_code_scanner select_scanner() {
+    return start_code_has_avx2() ? find_start_code_avx2 : find_start_code_sse2;
+}
+
+#else
+
+static start_code_scanner select_scanner() {
+    return find_start_code_scalar;
+}
+
+#endif
+
+const uint8_t* find_start_code(const uint8_t *begin, const uint8_t *end) {
+    static const start_code_scanner scanner = select_scanner();
+    return scanner(begin, end);
+}
@@ -0,0 +1,21 @@
+#include <cstdint>
+
+// Start code scanning (00 00 01 xx)
+//
+// All scanners return a pointer to the first 00 00 01 prefix that lies
+// completely inside [begin, end), or end if there is none.
+
+typedef const uint8_t* (*start_code_scanner)(const uint8_t *begin, const uint8_t *end);
+
+const uint8_t* find_start_code(const uint8_t *begin, const uint8_t *end);
+
+const uint8_t* find_start_code_scalar(const uint8_t *begin, const uint8_t *end);
+
+#if defined(__x86_64__) || defined(__i386__)
+#define START_CODE_HAS_X86
+
+const uint8_t* find_start_code_sse2(const uint8_t *begin, const uint8_t *end);
+const uint8_t* find_start_code_avx2(const uint8_t *begin, const uint8_t *end);
+
+bool start_code_has_avx2();
+#endif
@@ -0,0 +1,483 @@
+#include "VLC.h"
+
+// Codes that are not allowed decode to 0. They are listed so that every
+// table covers all bit patterns.
+#define VLC_INVALID                         0
+
+// A code as written in the standard, spaces between the bits are ignored
+typedef struct {
+    const char *bits;
+    int16_t value;
+} VLC_CODE;
+
+// A DCT coefficient code without the sign bit that follows it
+typedef struct {
+    const char *bits;
+    uint8_t run;
+    uint8_t level;
+} VLC_COEFF_CODE;
+
+// Table B.1, 34 is macroblock_stuffing and 35 macroblock_escape
+static constexpr VLC_CODE MACROBLOCK_ADDRESS_INCREMENT_CODES[] = {
+    {"1",              1}, {"011",            2},
+    {"010",            3}, {"0011",           4},
+    {"0010",           5}, {"0001 1",         6},
+    {"0001 0",         7}, {"0000 111",       8},
+    {"0000 110",       9}, {"0000 1011",     10},
+    {"0000 1010",     11}, {"0000 1001",     12},
+    {"0000 1000",     13}, {"0000 0111",     14},
+    {"0000 0110",     15}, {"0000 0101 11",  16},
+    {"0000 0101 10",  17}, {"0000 0101 01",  18},
+    {"0000 0101 00",  19}, {"0000 0100 11",  20},
+    {"0000 0100 10",  21}, {"0000 0100 011", 22},
+    {"0000 0100 010", 23}, {"0000 0100 001", 24},
+    {"0000 0100 000", 25}, {"0000 0011 111", 26},
+    {"0000 0011 110", 27}, {"0000 0011 101", 28},
+    {"0000 0011 100", 29}, {"0000 0011 011", 30},
+    {"0000 0011 010", 31}, {"0000 0011 001", 32},
+    {"0000 0011 000", 33}, {"0000 0001 111", 34},
+    {"0000 0001 000", 35},
+
+    {"0000 0000",     VLC_INVALID}, {"0000 0010",     VLC_INVALID},
+    {"0000 0001 01",  VLC_INVALID}, {"0000 0001 10",  VLC_INVALID},
+    {"0000 0001 001", VLC_INVALID}, {"0000 0001 110", VLC_INVALID},
+};
+
+// Table B.2a, the values are the macroblock_type flags
+static constexpr VLC_CODE MACROBLOCK_TYPE_I_CODES[] = {
+    {"1",  0x01}, {"01", 0x11},
+
+    {"00", VLC_INVALID},
+};
+
+// Table B.2b
+static constexpr VLC_CODE MACROBLOCK_TYPE_P_CODES[] = {
+    {"1",       0x0a}, {"01",      0x02},
+    {"001",     0x08}, {"0001 1",  0x01},
+    {"0001 0",  0x1a}, {"0000 1",  0x12},
+    {"0000 01", 0x11},
+
+    {"0000 00", VLC_INVALID},
+};
+
+// Table B.2c
+static constexpr VLC_CODE MACROBLOCK_TYPE_B_CODES[] = {
+    {"10",      0x0c}, {"11",      0x0e},
+    {"010",     0x04}, {"011",     0x06},
+    {"0010",    0x08}, {"0011",    0x0a},
+    {"0001 1",  0x01}, {"0001 0",  0x1e},
+    {"0000 11", 0x1a}, {"0000 10", 0x16},
+    {"0000 01", 0x11},
+
+    {"0000 00", VLC_INVALID},
+};
+
+// Table B.4
+static constexpr VLC_CODE MOTION_CODE_CODES[] = {
+    {"0000 0011 001", -16}, {"0000 0011 011", -15},
+    {"0000 0011 101", -14}, {"0000 0011 111", -13},
+    {"0000 0100 001", -12}, {"0000 0100 011", -11},
+    {"0000 0100 11",  -10}, {"0000 0101 01",   -9},
+    {"0000 0101 11",   -8}, {"0000 0111",      -7},
+    {"0000 1001",      -6}, {"0000 1011",      -5},
+    {"0000 111",       -4}, {"0001 1",         -3},
+    {"0011",           -2}, {"011",            -1},
+    {"1",               0}, {"010",             1},
+    {"0010",            2}, {"0001 0",          3},
+    {"0000 110",        4}, {"0000 1010",       5},
+    {"0000 1000",       6}, {"0000 0110",       7},
+    {"0000 0101 10",    8}, {"0000 0101 00",    9},
+    {"0000 0100 10",   10}, {"0000 0100 010",  11},
+    {"0000 0100 000",  12}, {"0000 0011 110",  13},
+    {"0000 0011 100",  14}, {"0000 0011 010",  15},
+    {"0000 0011 000",  16},
+
+    {"0000 000",      VLC_INVALID}, {"0000 0010",     VLC_INVALID},
+};
+
+// Table B.3
+static constexpr VLC_CODE CODE_BLOCK_PATTERN_CODES[] = {
+    {"0101 1",       1}, {"0100 1",       2},
+    {"0011 01",      3}, {"1101",         4},
+    {"0010 111",     5}, {"0010 011",     6},
+    {"0001 1111",    7}, {"1100",         8},
+    {"0010 110",     9}, {"0010 010",    10},
+    {"0001 1110",   11}, {"1001 1",      12},
+    {"0001 1011",   13}, {"0001 0111",   14},
+    {"0001 0011",   15}, {"1011",        16},
+    {"0010 101",    17}, {"0010 001",    18},
+    {"0001 1101",   19}, {"1000 1",      20},
+    {"0001 1001",   21}, {"0001 0101",   22},
+    {"0001 0001",   23}, {"0011 11",     24},
+    {"0000 1111",   25}, {"0000 1101",   26},
+    {"0000 0001 1", 27}, {"0111 1",      28},
+    {"0000 1011",   29}, {"0000 0111",   30},
+    {"0000 0011 1", 31}, {"1010",        32},
+    {"0010 100",    33}, {"0010 000",    34},
+    {"0001 1100",   35}, {"0011 10",     36},
+    {"0000 1110",   37}, {"0000 1100",   38},
+    {"0000 0001 0", 39}, {"1000 0",      40},
+    {"0001 1000",   41}, {"0001 0100",   42},
+    {"0001 0000",   43}, {"0111 0",      44},
+    {"0000 1010",   45}, {"0000 0110",   46},
+    {"0000 0011 0", 47}, {"1001 0",      48},
+    {"0001 1010",   49}, {"0001 0110",   50},
+    {"0001 0010",   51}, {"0110 1",      52},
+    {"0000 1001",   53}, {"0000 0101",   54},
+    {"0000 0010 1", 55}, {"0110 0",      56},
+    {"0000 1000",   57}, {"0000 0100",   58},
+    {"0000 0010 0", 59}, {"111",         60},
+    {"0101 0",      61}, {"0100 0",      62},
+    {"0011 00",     63},
+
+    {"0000 0000",   VLC_INVALID},
+};
+
+// Table B.5a
+static constexpr VLC_CODE DCT_SIZE_LUMINANCE_CODES[] = {
+    {"100",      0}, {"00",       1},
+    {"01",       2}, {"101",      3},
+    {"110",      4}, {"1110",     5},
+    {"1111 0",   6}, {"1111 10",  7},
+    {"1111 110", 8},
+
+    {"1111 111", VLC_INVALID},
+};
+
+// Table B.5b
+static constexpr VLC_CODE DCT_SIZE_CHROMINANCE_CODES[] = {
+    {"00",        0}, {"01",        1},
+    {"10",        2}, {"110",       3},
+    {"1110",      4}, {"1111 0",    5},
+    {"1111 10",   6}, {"1111 110",  7},
+    {"1111 1110", 8},
+
+    {"1111 1111", VLC_INVALID},
+};
+
+// Table B.5c-f, except for the codes starting with 1 which differ between
+// the first coefficient of a block and the others (see vlc_coeff_leaves)
+static constexpr VLC_COEFF_CODE DCT_COEFF_CODES[] = {
+    {"0100",                 0,  2}, {"0010 1",               0,  3},
+    {"0000 110",             0,  4}, {"0010 0110",            0,  5},
+    {"0010 0001",            0,  6}, {"0000 0010 10",         0,  7},
+    {"0000 0001 1101",       0,  8}, {"0000 0001 1000",       0,  9},
+    {"0000 0001 0011",       0, 10}, {"0000 0001 0000",       0, 11},
+    {"0000 0000 1101 0",     0, 12}, {"0000 0000 1100 1",     0, 13},
+    {"0000 0000 1100 0",     0, 14}, {"0000 0000 1011 1",     0, 15},
+    {"0000 0000 0111 11",    0, 16}, {"0000 0000 0111 10",    0, 17},
+    {"0000 0000 0111 01",    0, 18}, {"0000 0000 0111 00",    0, 19},
+    {"0000 0000 0110 11",    0, 20}, {"0000 0000 0110 10",    0, 21},
+    {"0000 0000 0110 01",    0, 22}, {"0000 0000 0110 00",    0, 23},
+    {"0000 0000 0101 11",    0, 24}, {"0000 0000 0101 10",    0, 25},
+    {"0000 0000 0101 01",    0, 26}, {"0000 0000 0101 00",    0, 27},
+    {"0000 0000 0100 11",    0, 28}, {"0000 0000 0100 10",    0, 29},
+    {"0000 0000 0100 01",    0, 30}, {"0000 0000 0100 00",    0, 31},
+    {"0000 0000 0011 000",   0, 32}, {"0000 0000 0010 111",   0, 33},
+    {"0000 0000 0010 110",   0, 34}, {"0000 0000 0010 101",   0, 35},
+    {"0000 0000 0010 100",   0, 36}, {"0000 0000 0010 011",   0, 37},
+    {"0000 0000 0010 010",   0, 38}, {"0000 0000 0010 001",   0, 39},
+    {"0000 0000 0010 000",   0, 40}, {"011",                  1,  1},
+    {"0001 10",              1,  2}, {"0010 0101",            1,  3},
+    {"0000 0011 00",         1,  4}, {"0000 0001 1011",       1,  5},
+    {"0000 0000 1011 0",     1,  6}, {"0000 0000 1010 1",     1,  7},
+    {"0000 0000 0011 111",   1,  8}, {"0000 0000 0011 110",   1,  9},
+    {"0000 0000 0011 101",   1, 10}, {"0000 0000 0011 100",   1, 11},
+    {"0000 0000 0011 011",   1, 12}, {"0000 0000 0011 010",   1, 13},
+    {"0000 0000 0011 001",   1, 14}, {"0000 0000 0001 0011",  1, 15},
+    {"0000 0000 0001 0010",  1, 16}, {"0000 0000 0001 0001",  1, 17},
+    {"0000 0000 0001 0000",  1, 18}, {"0101",                 2,  1},
+    {"0000 100",             2,  2}, {"0000 0010 11",         2,  3},
+    {"0000 0001 0100",       2,  4}, {"0000 0000 1010 0",     2,  5},
+    {"0011 1",               3,  1}, {"0010 0100",            3,  2},
+    {"0000 0001 1100",       3,  3}, {"0000 0000 1001 1",     3,  4},
+    {"0011 0",               4,  1}, {"0000 0011 11",         4,  2},
+    {"0000 0001 0010",       4,  3}, {"0001 11",              5,  1},
+    {"0000 0010 01",         5,  2}, {"0000 0000 1001 0",     5,  3},
+    {"0001 01",              6,  1}, {"0000 0001 1110",       6,  2},
+    {"0000 0000 0001 0100",  6,  3}, {"0001 00",              7,  1},
+    {"0000 0001 0101",       7,  2}, {"0000 111",             8,  1},
+    {"0000 0001 0001",       8,  2}, {"0000 101",             9,  1},
+    {"0000 0000 1000 1",     9,  2}, {"0010 0111",           10,  1},
+    {"0000 0000 1000 0",    10,  2}, {"0010 0011",           11,  1},
+    {"0000 0000 0001 1010", 11,  2}, {"0010 0010",           12,  1},
+    {"0000 0000 0001 1001", 12,  2}, {"0010 0000",           13,  1},
+    {"0000 0000 0001 1000", 13,  2}, {"0000 0011 10",        14,  1},
+    {"0000 0000 0001 0111", 14,  2}, {"0000 0011 01",        15,  1},
+    {"0000 0000 0001 0110", 15,  2}, {"0000 0010 00",        16,  1},
+    {"0000 0000 0001 0101", 16,  2}, {"0000 0001 1111",      17,  1},
+    {"0000 0001 1010",      18,  1}, {"0000 0001 1001",      19,  1},
+    {"0000 0001 0111",      20,  1}, {"0000 0001 0110",      21,  1},
+    {"0000 0000 1111 1",    22,  1}, {"0000 0000 1111 0",    23,  1},
+    {"0000 0000 1110 1",    24,  1}, {"0000 0000 1110 0",    25,  1},
+    {"0000 0000 1101 1",    26,  1}, {"0000 0000 0001 1111", 27,  1},
+    {"0000 0000 0001 1110", 28,  1}, {"0000 0000 0001 1101", 29,  1},
+    {"0000 0000 0001 1100", 30,  1}, {"0000 0000 0001 1011", 31,  1},
+
+    // Followed by a 6 bit run and an 8 or 16 bit level
+    {"0000 01",             DCT_COEFF_ESCAPE, 0},
+
+    {"0000 0000 0000",      VLC_INVALID, VLC_INVALID},
+};
+
+typedef struct {
+    uint32_t code;
+    int length;
+    VLC_LUT entry;
+} VLC_LEAF;
+
+template<size_t N>
+struct VLC_LEAVES {
+    VLC_LEAF leaves[N] {};
+    size_t count {0};
+
+    constexpr void add(uint32_t code, int length, int16_t value, uint8_t run = 0) {
+        leaves[count++] = {code, length, {value, (int8_t)length, run}};
+    }
+};
+
+constexpr uint32_t vlc_parse_code(const char *bits, int *length) {
+    uint32_t code = 0;
+    *length = 0;
+
+    for(const char *c = bits; *c; c++) {
+        if(*c != ' ') {
+            code = (code << 1) | (*c == '1');
+            (*length)++;
+        }
+    }
+
+    return code;
+}
+
+template<size_t N>
+constexpr VLC_LEAVES<N> vlc_leaves(const VLC_CODE (&codes)[N]) {
+    VLC_LEAVES<N> result;
+    for(size_t i = 0; i < N; i++) {
+        int length = 0;
+        uint32_t code = vlc_parse_code(codes[i].bits, &length);
+        result.add(code, length, codes[i].value);
+    }
+
+    return result;
+}
+
+// DCT coefficients including their sign, so one lookup gives run, signed
+// level and the full length. The code 1 is run 0, level 1 for the first
+// coefficient of a block and the start of 10 (end of block) or 11 (run 0,
+// level 1) for all others.
+template<size_t N>
+constexpr VLC_LEAVES<2 * N + 3> vlc_coeff_leaves(const VLC_COEFF_CODE (&codes)[N], bool first) {
+    VLC_LEAVES<2 * N + 3> result;
+
+    uint32_t code = first ? 0x1 : 0x3;
+    int length = first ? 1 : 2;
+    result.add(code << 1, length + 1, 1);
+    result.add((code << 1) | 1, length + 1, -1);
+
+    if(!first) {
+        result.add(0x2, 2, 0, DCT_COEFF_END_OF_BLOCK);
+    }
+
+    for(size_t i = 0; i < N; i++) {
+        code = vlc_parse_code(codes[i].bits, &length);
+
+        if(codes[i].level == 0) {
+            result.add(code, length, 0, codes[i].run);
+        } else {
+            result.add(code << 1, length + 1, codes[i].level, codes[i].run);
+            result.add((code << 1) | 1, length + 1, -codes[i].level, codes[i].run);
+        }
+    }
+
+    return result;
+}
+
+// DCT coefficients without their sign as one value, run << 8 | level. The
+// code 1 is 0x0001 and the escape 0xFFFF.
+template<size_t N>
+constexpr VLC_LEAVES<N + 1> vlc_coeff_value_leaves(const VLC_COEFF_CODE (&codes)[N]) {
+    VLC_LEAVES<N + 1> result;
+    result.add(0x1, 1, 0x0001);
+
+    for(size_t i = 0; i < N; i++) {
+        int length = 0;
+        uint32_t code = vlc_parse_code(codes[i].bits, &length);
+
+        if(codes[i].run == DCT_COEFF_ESCAPE) {
+            result.add(code, length, (int16_t)0xFFFF);
+        } else {
+            result.add(code, length, (codes[i].run << 8) | codes[i].level);
+        }
+    }
+
+    return result;
+}
+
+// No code is the start of another
+template<size_t N>
+constexpr bool vlc_is_prefix_free(const VLC_LEAVES<N> &leaves) {
+    for(size_t i = 0; i < leaves.count; i++) {
+        for(size_t j = 0; j < leaves.count; j++) {
+            const VLC_LEAF &a = leaves.leaves[i];
+            const VLC_LEAF &b = leaves.leaves[j];
+            if(i != j && a.length <= b.length && (b.code >> (b.length - a.length)) == a.code) {
+                return false;
+            }
+        }
+    }
+
+    return true;
+}
+
+// Every bit pattern starts with one of the codes, the fractions of the code
+// space taken by the codes add up to exactly 1
+template<size_t N>
+constexpr bool vlc_is_complete(const VLC_LEAVES<N> &leaves) {
+    uint64_t sum = 0;
+    for(size_t i = 0; i < leaves.count; i++) {
+        if(leaves.leaves[i].length < 1 || leaves.leaves[i].length > VLC_MAX_LENGTH) {
+            return false;
+        }
+
+        sum += (uint64_t)1 << (VLC_MAX_LENGTH - leaves.leaves[i].length);
+    }
+
+    return sum == (uint64_t)1 << VLC_MAX_LENGTH;
+}
+
+// Bits indexing the second level table behind every first level entry, 0
+// when all codes starting with it fit in the first level
+typedef struct {
+    int bits[1 << VLC_LUT_BITS] {};
+    size_t size {0};
+} VLC_LUT_LAYOUT;
+
+template<size_t N>
+constexpr VLC_LUT_LAYOUT vlc_lut_layout(const VLC_LEAVES<N> &leaves) {
+    VLC_LUT_LAYOUT layout;
+    for(size_t i = 0; i < leaves.count; i++) {
+        const VLC_LEAF &leaf = leaves.leaves[i];
+        if(leaf.length > VLC_LUT_BITS) {
+            int &bits = layout.bits[leaf.code >> (leaf.length - VLC_LUT_BITS)];
+            if(leaf.length - VLC_LUT_BITS > bits) {
+                bits = leaf.length - VLC_LUT_BITS;
+            }
+        }
+    }
+
+    layout.size = 1 << VLC_LUT_BITS;
+    for(int prefix = 0; prefix < (1 << VLC_LUT_BITS); prefix++) {
+        if(layout.bits[prefix]) {
+            layout.size += 1 << layout.bits[prefix];
+        }
+    }
+
+    return layout;
+}
+
+template<size_t SIZE>
+struct VLC_LUT_ENTRIES {
+    VLC_LUT entries[SIZE] {};
+};
+
+template<size_t SIZE, size_t N>
+constexpr VLC_LUT_ENTRIES<SIZE> vlc_build_lut(const VLC_LEAVES<N> &leaves) {
+    VLC_LUT_ENTRIES<SIZE> result;
+    VLC_LUT_LAYOUT layout = vlc_lut_layout(leaves);
+
+    // Second level tables follow the first level
+    size_t next = 1 << VLC_LUT_BITS;
+    for(int prefix = 0; prefix < (1 << VLC_LUT_BITS); prefix++) {
+        int bits = layout.bits[prefix];
+        if(bits) {
+            result.entries[prefix] = {(int16_t)next, (int8_t)-bits, 0};
+            next += 1 << bits;
+        }
+    }
+
+    // Every code fills all entries that start with it
+    for(size_t i = 0; i < leaves.count; i++) {
+        VLC_LUT *first = result.entries;
+        uint32_t code = leaves.leaves[i].code;
+        int length = leaves.leaves[i].length;
+        int bits = VLC_LUT_BITS;
+
+        if(length > VLC_LUT_BITS) {
+            VLC_LUT link = result.entries[code >> (length - VLC_LUT_BITS)];
+            first = result.entries + link.value;
+            bits = -link.length;
+
+            code &= (1 << (length - VLC_LUT_BITS)) - 1;
+            length -= VLC_LUT_BITS;
+        }
+
+        int shift = bits - length;
+        for(int j = 0; j < (1 << shift); j++) {
+            first[(code << shift) + j] = leaves.leaves[i].entry;
+        }
+    }
+
+    return result;
+}
+
+// A complete tree has one node less than it has leaves, and two entries per node
+template<size_t N>
+constexpr size_t vlc_tree_size(const VLC_LEAVES<N> &leaves) {
+    return 2 * (leaves.count - 1);
+}
+
+template<size_t SIZE>
+struct VLC_TREE {
+    VLC entries[SIZE] {};
+};
+
+template<size_t SIZE, size_t N>
+constexpr VLC_TREE<SIZE> vlc_build_tree(const VLC_LEAVES<N> &leaves) {
+    VLC_TREE<SIZE> result;
+
+    int nr_of_nodes = 1;
+    for(size_t i = 0; i < leaves.count; i++) {
+        const VLC_LEAF &leaf = leaves.leaves[i];
+
+        int node = 0;
+        for(int bit_index = leaf.length - 1; bit_index > 0; bit_index--) {
+            VLC &entry = result.entries[node + ((leaf.code >> bit_index) & 1)];
+            if(entry.index == 0) {
+                entry.index = (nr_of_nodes++) << 1;
+            }
+            node = entry.index;
+        }
+
+        result.entries[node + (leaf.code & 1)] = {0, leaf.entry.value};
+    }
+
+    return result;
+}
+
+// Defines the tree form NAME and the lookup tables NAME_LUT from a list of
+// leaves, which has to be prefix free and complete
+#define VLC_DEFINE_TABLES(NAME, LEAVES)                                                         \
+    static constexpr auto NAME##_LEAVES = LEAVES;                                               \
+    static_assert(vlc_is_prefix_free(NAME##_LEAVES), #NAME " has a code that starts another"); \
+    static_assert(vlc_is_complete(NAME##_LEAVES), #NAME " doesn't cover every bit pattern");    \
+    static constexpr auto NAME##_TREE = vlc_build_tree<vlc_tree_size(NAME##_LEAVES)>(NAME##_LEAVES); \
+    const VLC *const NAME = NAME##_TREE.entries;                                                \
+    static constexpr auto NAME##_LUT_ENTRIES = vlc_build_lut<vlc_lut_layout(NAME##_LEAVES).size>(NAME##_LEAVES); \
+    const VLC_TABLE NAME##_LUT = {NAME##_LUT_ENTRIES.entries, vlc_lut_layout(NAME##_LEAVES).size};
+
+VLC_DEFINE_TABLES(MACROBLOCK_ADDRESS_INCREMENT, vlc_leaves(MACROBLOCK_ADDRESS_INCREMENT_CODES))
+VLC_DEFINE_TABLES(MACROBLOCK_TYPE_I, vlc_leaves(MACROBLOCK_TYPE_I_CODES))
+VLC_DEFINE_TABLES(MACROBLOCK_TYPE_P, vlc_leaves(MACROBLOCK_TYPE_P_CODES))
+VLC_DEFINE_TABLES(MACROBLOCK_TYPE_B, vlc_leaves(MACROBLOCK_TYPE_B_CODES))
+VLC_DEFINE_TABLES(MOTION_CODE, vlc_leaves(MOTION_CODE_CODES))
+VLC_DEFINE_TABLES(CODE_BLOCK_PATTERN, vlc_leaves(CODE_BLOCK_PATTERN_CODES))
+VLC_DEFINE_TABLES(DCT_SIZE_LUMINANCE, vlc_leaves(DCT_SIZE_LUMINANCE_CODES))
+VLC_DEFINE_TABLES(DCT_SIZE_CHROMINANCE, vlc_leaves(DCT_SIZE_CHROMINANCE_CODES))
+VLC_DEFINE_TABLES(DCT_COEFF, vlc_coeff_value_leaves(DCT_COEFF_CODES))
+
+// DCT_COEFF including the sign bit, for the first coefficient of a non-intra
+// block and for all others
+VLC_DEFINE_TABLES(DCT_COEFF_FIRST, vlc_coeff_leaves(DCT_COEFF_CODES, true))
+VLC_DEFINE_TABLES(DCT_COEFF_NEXT, vlc_coeff_leaves(DCT_COEFF_CODES, false))
+
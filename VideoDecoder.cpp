@@ -1,4 +1,6 @@
 #include "VideoDecoder.h"
+#include "Demuxer.h"
+#include "IDCT.h"
 #include <math.h>
 #include <chrono>
 
@@ -17,9 +19,14 @@
 
 #define PICTURE_TYPE_I                  1
 #define PICTURE_TYPE_P                  2
-#define PICTURE_TYPE_B                  3   // Unsupported (for now)
+#define PICTURE_TYPE_B                  3
 #define PICTURE_TYPE_D                  4   // Unsupported
 
+#define VBV_BUFFER_UNIT                 2048    // 16 kbit in bytes
+
+// A GOP start code lies in the first packet demuxed after seeking to its offset
+#define MAX_PACKET_SIZE                 65536
+
 #define PI                              3.1415926
 
 static const int sign(int n) {
@@ -34,34 +41,133 @@ static const int sign(int n) {
     return -1;
 }
 
-VideoDecoder::VideoDecoder(BitStream *stream, queue<Mat *> *display_buffer) {
+VideoDecoder::VideoDecoder(BitStream *stream, DisplayQueue *display_buffer) {
     this->stream = stream;
     this->display_buffer = display_buffer;
+
+    slice_view = new BitStream();
+    slice_copy = new BitStream();
+    frame_pool = new FramePool();
+
+    // Coefficients are only cleared after each macroblock
+    reset_blocks();
+}
+
+VideoDecoder::VideoDecoder(Demuxer *demuxer, DisplayQueue *display_buffer)
+    : VideoDecoder(demuxer->video_stream, display_buffer) {
+    this->demuxer = demuxer;
+    demuxer->track_video_packets = true;
 }
 
 void VideoDecoder::decode() {
     video_sequence();
+    display_buffer->close();
+}
+
+void VideoDecoder::print_stats() {
+    printf("Frames allocated: %lu\n", frame_pool->nr_of_frames);
+    printf("Damaged pictures: %lu, damaged slices: %lu, concealed macroblocks: %lu\n",
+            picture_errors, slice_errors, concealed_macroblocks);
 }
 
 void VideoDecoder::video_sequence() {
-    stream->next_start_code();
-    do {
+    // After a seek the stream already is at a GOP and the sequence header was
+    // read. Otherwise decoding starts at the first intact sequence header.
+    while(stream->start_code != GROUP_START_CODE) {
+        do {
+            stream->next_start_code();
+        } while(stream->start_code != -1 && stream->start_code != SEQUENCE_HEADER_START_CODE);
+
+        if(stream->start_code == -1) {
+            return;
+        }
+
         sequence_header();
+    }
 
-        do {
-            group_of_pictures();
-        } while(stream->start_code == GROUP_START_CODE);
-    } while(stream->start_code == SEQUENCE_HEADER_START_CODE);
+    while(stream->start_code == GROUP_START_CODE && !display_buffer->is_closed()) {
+        group_of_pictures();
+
+        if(stream->start_code == SEQUENCE_HEADER_START_CODE) {
+            sequence_header();
+        }
+    }
+
+    // The last reference picture has nothing after it
+    if(reference_pending) {
+        output_frame(frame_backward);
+        reference_pending = false;
+    }
 }
 
-void VideoDecoder::sequence_header() {
+bool VideoDecoder::seek(const SeekIndexEntry *entry, double seconds) {
+    // The GOP may be long after its sequence header, which is parsed first
+    if(!demuxer || !entry || !demuxer->seek(entry->sequence_offset)) {
+        return false;
+    }
+
+    do {
+        stream->next_start_code();
+    } while(stream->start_code != -1 && stream->start_code != SEQUENCE_HEADER_START_CODE);
+
+    if(stream->start_code == -1 || !sequence_header()) {
+        return false;
+    }
+
+    if(!demuxer->seek(entry->offset)) {
+        return false;
+    }
+
+    // More than one GOP can start in the packet, their time codes tell them apart
+    size_t start = stream->position();
+    do {
+        stream->next_start_code();
+    } while(stream->start_code != -1 && stream->position() - start < MAX_PACKET_SIZE &&
+            !(stream->start_code == GROUP_START_CODE && (uint32_t)stream->peek(25) == entry->time_code));
+
+    if(stream->start_code != GROUP_START_CODE) {
+        return false;
+    }
+
+    // Interpolation starts over from the next PTS
+    last_pts = -1;
+
+    // The pictures before the GOP aren't shown, and the B-pictures that
+    // reference them are dropped
+    nr_of_references = 0;
+    reference_pending = false;
+
+    nr_of_frames_to_skip = 0;
+    if(seconds > entry->time) {
+        nr_of_frames_to_skip = (size_t)((seconds - entry->time) * frame_rate + 0.5);
+    }
+
+    return true;
+}
+
+// Fails on forbidden values, the header is then skipped and the previous
+// one stays in effect
+bool VideoDecoder::sequence_header() {
     // The width of the displayable part of each luminance picture in pixels. (left-aligned)
-    width = stream->consume(12);
+    int horizontal_size = stream->consume(12);
     // The height of the displayable part of each luminance picture in pixels. (top-aligned)
-    height = stream->consume(12);
+    int vertical_size = stream->consume(12);
+
+    int aspect_ratio_code = stream->consume(4);
+    int frame_rate_code = stream->consume(4);
+
+    if(horizontal_size == 0 || vertical_size == 0 ||
+            aspect_ratio_code == 0 || aspect_ratio_code > 14 ||
+            frame_rate_code == 0 || frame_rate_code > 8) {
+        picture_errors++;
+        return false;
+    }
 
-    aspect_ratio = ASPECT_RATIO[stream->consume(4)];
-    frame_rate = FRAME_RATE[stream->consume(4)];
+    width = horizontal_size;
+    height = vertical_size;
+
+    aspect_ratio = ASPECT_RATIO[aspect_ratio_code];
+    frame_rate = FRAME_RATE[frame_rate_code];
 
     // The bit rate of the bit stream measured in units of 400 bits/second, rounded upwards
     // 0 is forbidden, 3FFFF is variable bit rate
@@ -70,8 +176,19 @@ void VideoDecoder::sequence_header() {
     // Marker bit
     stream->skip(1);
 
-    // vbv buffer size
-    stream->skip(10);
+    // Size of the video buffering verifier buffer in units of 16 kbit, no coded
+    // picture is larger than this so it bounds how much of the stream has to
+    // be buffered at once
+    vbv_buffer_size = stream->consume(10);
+
+    // The window is the one of the stream that buffers the data, the file
+    // stream when the video is a chained stream of views into it
+    BitStream *buffered_stream = stream->parent_stream ? stream->parent_stream : stream;
+
+    size_t vbv_bytes = (size_t)vbv_buffer_size * VBV_BUFFER_UNIT;
+    if(buffered_stream->window_size < 2 * vbv_bytes) {
+        buffered_stream->window_size = 2 * vbv_bytes;
+    }
 
     // constrained parameter flag
     stream->skip(1);
@@ -108,7 +225,7 @@ void VideoDecoder::sequence_header() {
 
 
     // Skip extension and user data
-    while(stream->start_code != GROUP_START_CODE) {
+    while(stream->start_code != -1 && stream->start_code != GROUP_START_CODE) {
         stream->next_start_code();
     }
 
@@ -117,38 +234,57 @@ void VideoDecoder::sequence_header() {
     printf("Width: %d\nHeight: %d\n", width, height);
     printf("mb_width: %d\nmb_height: %d\n", mb_width, mb_height);
     printf("Frame rate: %0.2f\n", frame_rate);
+
+    return true;
 }
 
+// Every sequence header (and every seek) gets here, the references are only
+// replaced when the size changed
 void VideoDecoder::init_frames() {
-    frame_current = (Frame*)malloc(sizeof(Frame));
-    frame_current->y = (uint8_t*)malloc(sizeof(uint8_t)*width*height);
-    frame_current->cb = (uint8_t*)malloc(sizeof(uint8_t)*width*height);
-    frame_current->cr = (uint8_t*)malloc(sizeof(uint8_t)*width*height);
+    macroblock_decoded = (bool*)realloc(macroblock_decoded, sizeof(bool)*mb_width*mb_height);
 
-    frame_prev = (Frame*)malloc(sizeof(Frame));
-    frame_prev->y = (uint8_t*)malloc(sizeof(uint8_t)*width*height);
-    frame_prev->cb = (uint8_t*)malloc(sizeof(uint8_t)*width*height);
-    frame_prev->cr = (uint8_t*)malloc(sizeof(uint8_t)*width*height);
-}
+    if(frame_forward && frame_forward->width == width && frame_forward->height == height) {
+        return;
+    }
+
+    frame_pool->set_size(width, height);
 
-void VideoDecoder::set_prev_frame() {
-    memcpy(frame_prev->y, frame_current->y, sizeof(uint8_t)*width*height);
-    memcpy(frame_prev->cb, frame_current->cb, sizeof(uint8_t)*width*height);
-    memcpy(frame_prev->cr, frame_current->cr, sizeof(uint8_t)*width*height);
+    // Black, for macroblocks concealed before the first intact I-picture
+    Frame **references[] = {&frame_forward, &frame_backward};
+    for(Frame **frame : references) {
+        if(*frame) {
+            frame_pool->release(*frame);
+        }
+
+        *frame = frame_pool->acquire();
+
+        size_t plane_size = (size_t)(*frame)->stride*(*frame)->coded_height;
+        size_t chroma_plane_size = (size_t)(*frame)->chroma_stride*((*frame)->coded_height/2);
+        memset((*frame)->y, 0, plane_size);
+        memset((*frame)->cb, 128, chroma_plane_size);
+        memset((*frame)->cr, 128, chroma_plane_size);
+    }
+
+    nr_of_references = 0;
+    reference_pending = false;
 }
 
 void VideoDecoder::group_of_pictures() {
-    // Time code
-    stream->skip(25);
+    // Drop frame flag, hours, minutes, marker bit, seconds and pictures
+    time_code = stream->consume(25);
 
-    // Closed GOP
-    stream->skip(1);
+    // The B-pictures right after the I-picture don't need the previous GOP
+    closed_gop = stream->consume(1);
 
-    // Broken link
-    stream->skip(1);
+    // The previous GOP is missing (an edit), those B-pictures can't be decoded
+    broken_link = stream->consume(1);
+
+    if(broken_link) {
+        nr_of_references = 0;
+    }
 
     // Skip extension and user data
-    while(stream->start_code != PICTURE_START_CODE) {
+    while(stream->start_code != -1 && stream->start_code != PICTURE_START_CODE) {
         stream->next_start_code();
     }
 
@@ -169,23 +305,32 @@ void VideoDecoder::group_of_pictures() {
 
         printf("\t%0.5f ms\n", ms_double.count());
 
-        add_frame_to_buffer();
-        // write_image();
-
-        while(stream->start_code != PICTURE_START_CODE) {
+        while(stream->start_code != -1 && stream->start_code != PICTURE_START_CODE) {
             stream->next_start_code();
         }
-
-        set_prev_frame();
     } while(stream->start_code == PICTURE_START_CODE);
 }
 
+// I- and P-pictures replace the older reference, they are shown once the
+// next one comes in, after the B-pictures between the two (which precede it
+// in temporal_reference).
 void VideoDecoder::picture() {
+    double pts = picture_pts();
+
     temporal_reference = stream->consume(10);
     picture_coding_type = stream->consume(3);
     // printf("Picture: %d (%d)\n", temporal_reference, picture_coding_type);
 
-    if(picture_coding_type == PICTURE_TYPE_B) { // Unsupported (for now)
+    // D-pictures and forbidden types are skipped
+    if(picture_coding_type < PICTURE_TYPE_I || picture_coding_type > PICTURE_TYPE_B) {
+        picture_errors++;
+        stream->next_start_code();
+        return;
+    }
+
+    // Without both references (at the start, after a seek or a broken link)
+    // a B-picture can't be decoded and isn't shown
+    if(picture_coding_type == PICTURE_TYPE_B && nr_of_references < 2) {
         stream->next_start_code();
         return;
     }
@@ -198,6 +343,7 @@ void VideoDecoder::picture() {
         int forward_f_code = stream->consume(3);
 
         if(forward_f_code == 0) { // Forbidden value
+            picture_errors++;
             return;
         }
 
@@ -212,6 +358,7 @@ void VideoDecoder::picture() {
         int backward_f_code = stream->consume(3);
 
         if(backward_f_code == 0) { // Forbidden value
+            picture_errors++;
             return;
         }
 
@@ -221,72 +368,165 @@ void VideoDecoder::picture() {
         backward_f = 1 << backward_r_size;
     }
 
+    if(picture_coding_type == PICTURE_TYPE_B) {
+        frame_current = frame_pool->acquire();
+    } else {
+        if(reference_pending) {
+            output_frame(frame_backward);
+        }
+
+        // The older reference isn't needed anymore
+        frame_pool->release(frame_forward);
+        frame_forward = frame_backward;
+        frame_backward = frame_current = frame_pool->acquire();
+    }
+
+    frame_current->pts = pts;
+
     // Skip user and extension data + extra picture information
     do {
         stream->next_start_code();
-    } while(!(stream->start_code >= SLICE_CODE_START &&
-                stream->start_code <= SLICE_CODE_END));
+    } while(stream->start_code == EXTENSION_START_CODE ||
+            stream->start_code == USER_DATA_START_CODE);
 
-    do {
+    memset(macroblock_decoded, 0, sizeof(bool)*mb_width*mb_height);
+
+    // Without any slices (damaged) the picture is concealed as a whole
+    while(stream->start_code >= SLICE_CODE_START &&
+            stream->start_code <= SLICE_CODE_END) {
         slice();
         if(macroblock_address == (mb_width * mb_height) - 1) {
             break;
         }
         stream->next_start_code();
-    } while(stream->start_code >= SLICE_CODE_START && 
-            stream->start_code <= SLICE_CODE_END);
+    }
+
+    conceal_macroblocks();
+
+    if(picture_coding_type == PICTURE_TYPE_B) {
+        output_frame(frame_current);
+        frame_pool->release(frame_current);
+    } else {
+        nr_of_references = std::min(nr_of_references + 1, 2);
+        reference_pending = true;
+    }
+}
+
+// Macroblocks of damaged or missing slices are copied from the last reference
+// picture before (the forward one)
+void VideoDecoder::conceal_macroblocks() {
+    for(int address = 0; address < mb_width * mb_height; address++) {
+        if(macroblock_decoded[address]) {
+            continue;
+        }
+
+        int row = (address / mb_width) * 16;
+        int col = (address % mb_width) * 16;
+        int stride = frame_current->stride;
+
+        for(int i = row; i < row + 16; i++) {
+            size_t index = (size_t)i * stride + col;
+            memcpy(frame_current->y + index, frame_forward->y + index, 16);
+        }
+
+        int chroma_stride = frame_current->chroma_stride;
+        row /= 2;
+        col /= 2;
+
+        for(int i = row; i < row + 8; i++) {
+            size_t index = (size_t)i * chroma_stride + col;
+            memcpy(frame_current->cb + index, frame_forward->cb + index, 8);
+            memcpy(frame_current->cr + index, frame_forward->cr + index, 8);
+        }
+
+        concealed_macroblocks++;
+    }
 }
 
 void VideoDecoder::slice() {
     slice_vertical_position = stream->start_code & 0x000000FF;
     // printf("\tSlice:\t%d @ %lu\n", slice_vertical_position, stream->bit_index);
 
-    quantizer_scale = stream->consume(5);
+    // The whole slice up to the next start code is decoded without any bounds
+    // checks. It is read in place when stream holds all of it, only a slice
+    // that crosses the end of a packet (or of the buffered data) is copied.
+    if(stream->view_until_start_code(slice_view)) {
+        slice_stream = slice_view;
+    } else {
+        stream->copy_until_start_code(slice_copy);
+        slice_stream = slice_copy;
+    }
+    slice_bits = slice_stream->size << 3;
+
+    quantizer_scale = slice_stream->consume_unchecked(5);
 
     macroblock_address = (slice_vertical_position - 1) * mb_width - 1;
     dct_dc_past[0] = dct_dc_past[1] = dct_dc_past[2] = 1024;
     past_intra_address = -2;
     recon_right_for_prev = recon_down_for_prev = 0;
+    recon_right_back_prev = recon_down_back_prev = 0;
     first_mb_in_slice = true;
 
     // Skip extra slice information
-    while(stream->consume(1)) {
-        stream->skip(8);
+    while(slice_stream->bit_index < slice_bits && slice_stream->consume_unchecked(1)) {
+        slice_stream->skip_unchecked(8);
     }
 
+    // The slice ends with its bits or at 23 zero bits (stuffing before the
+    // next start code). The reads past its end stay within the padding, the
+    // next start code in place or zeros in a copy. The rest of a damaged
+    // slice is dropped, decoding resyncs at the next slice start code.
     do {
-        macroblock();
-    } while(macroblock_address < (mb_width*mb_height) - 1 && 
-                stream->no_start_code());
+        if(!macroblock()) {
+            slice_errors++;
+            return;
+        }
+    } while(macroblock_address < (mb_width*mb_height) - 1 &&
+                slice_stream->bit_index < slice_bits &&
+                slice_stream->peek_unchecked(23) != 0);
 }
 
-void VideoDecoder::macroblock() {
+// Fails on a code or value that can't be in an intact slice
+bool VideoDecoder::macroblock() {
     int increment = 0;
-    int t = read_vlc(stream, MACROBLOCK_ADDRESS_INCREMENT);
+    int t = read_vlc(slice_stream, &MACROBLOCK_ADDRESS_INCREMENT_LUT);
 
     while(t == 34) {
-        t = read_vlc(stream, MACROBLOCK_ADDRESS_INCREMENT);
+        t = read_vlc(slice_stream, &MACROBLOCK_ADDRESS_INCREMENT_LUT);
     }
 
     while(t == 35) {
         increment += 33;
-        t = read_vlc(stream, MACROBLOCK_ADDRESS_INCREMENT);
+        t = read_vlc(slice_stream, &MACROBLOCK_ADDRESS_INCREMENT_LUT);
     }
 
     increment += t;
 
+    if(t == 0 || macroblock_address + increment >= mb_width * mb_height) {
+        return false;
+    }
+
     if(first_mb_in_slice) {
         first_mb_in_slice = false;
         macroblock_address += increment;
     } else {
-        if(increment > 1) {
+        // Skipped macroblocks of a P-picture are copied from the reference,
+        // those of a B-picture are predicted like the macroblock before
+        if(increment > 1 && picture_coding_type == PICTURE_TYPE_P) {
             recon_down_for_prev = recon_right_for_prev = 0;
             recon_down_for = recon_right_for = 0;
         }
 
+        if(increment > 1 && picture_coding_type == PICTURE_TYPE_B && macroblock_intra) {
+            return false;
+        }
+
         while(increment > 1) {
             macroblock_address++;
-            predict_macroblock();
+            if(!predict_macroblock()) {
+                return false;
+            }
+            macroblock_decoded[macroblock_address] = true;
             increment--;
         }
 
@@ -296,15 +536,16 @@ void VideoDecoder::macroblock() {
     mb_row = macroblock_address / mb_width;
     mb_col = macroblock_address % mb_width;
 
-    if(mb_col >= mb_width || mb_row >= mb_height) {
-        fputs("Wrong macroblock dimensions\n", stderr);
-        exit(1);
-    }
-
     if(picture_coding_type == PICTURE_TYPE_I) {
-        mb_type = read_vlc(stream, MACROBLOCK_TYPE_I);
+        mb_type = read_vlc(slice_stream, &MACROBLOCK_TYPE_I_LUT);
     } else if(picture_coding_type == PICTURE_TYPE_P) {
-        mb_type = read_vlc(stream, MACROBLOCK_TYPE_P);
+        mb_type = read_vlc(slice_stream, &MACROBLOCK_TYPE_P_LUT);
+    } else {
+        mb_type = read_vlc(slice_stream, &MACROBLOCK_TYPE_B_LUT);
+    }
+
+    if(mb_type == 0) {
+        return false;
     }
 
     macroblock_intra = (mb_type & 0x01);
@@ -314,41 +555,60 @@ void VideoDecoder::macroblock() {
     macroblock_quant = (mb_type & 0x10);
 
     if(macroblock_quant) {
-        quantizer_scale = stream->consume(5);
+        quantizer_scale = slice_stream->consume_unchecked(5);
     }
 
     if(macroblock_motion_forward) {
-        motion_horizontal_forward_code = read_vlc(stream, MOTION_CODE);
+        motion_horizontal_forward_code = read_vlc(slice_stream, &MOTION_CODE_LUT);
         if((forward_f != 1) && (motion_horizontal_forward_code != 0)) {
-            motion_horizontal_forward_r = stream->consume(forward_r_size);
+            motion_horizontal_forward_r = slice_stream->consume_unchecked(forward_r_size);
         }
 
-        motion_vertical_forward_code = read_vlc(stream, MOTION_CODE);
+        motion_vertical_forward_code = read_vlc(slice_stream, &MOTION_CODE_LUT);
         if((forward_f != 1) && (motion_vertical_forward_code != 0)) {
-            motion_vertical_forward_r = stream->consume(forward_r_size);
+            motion_vertical_forward_r = slice_stream->consume_unchecked(forward_r_size);
         }
 
         reconstruct_forward_motion_vectors();
-    } else {
+    } else if(picture_coding_type == PICTURE_TYPE_P) {
         recon_down_for = recon_right_for = 0;
     }
 
-    // TODO: Implement macroblock_motion_backward for B-frames
+    if(macroblock_motion_backward) {
+        motion_horizontal_backward_code = read_vlc(slice_stream, &MOTION_CODE_LUT);
+        if((backward_f != 1) && (motion_horizontal_backward_code != 0)) {
+            motion_horizontal_backward_r = slice_stream->consume_unchecked(backward_r_size);
+        }
+
+        motion_vertical_backward_code = read_vlc(slice_stream, &MOTION_CODE_LUT);
+        if((backward_f != 1) && (motion_vertical_backward_code != 0)) {
+            motion_vertical_backward_r = slice_stream->consume_unchecked(backward_r_size);
+        }
+
+        reconstruct_backward_motion_vectors();
+    }
 
     int cbp = (macroblock_pattern != 0) ? 
-                read_vlc(stream, CODE_BLOCK_PATTERN) :
+                read_vlc(slice_stream, &CODE_BLOCK_PATTERN_LUT) :
                 (macroblock_intra ? 0x3F : 0);
 
+    if(macroblock_pattern && cbp == 0) {
+        return false;
+    }
+
     if(macroblock_intra) {
         recon_down_for = recon_right_for = 0;
         recon_down_for_prev = recon_right_for_prev = 0;
-    } else {
-        predict_macroblock();
+        recon_down_back = recon_right_back = 0;
+        recon_down_back_prev = recon_right_back_prev = 0;
+    } else if(!predict_macroblock()) {
+        return false;
     }
 
     for(int i = 0, mask = 0x20; i < 6; i++) {
-        if((cbp & mask) != 0) {
-            block(i);
+        if((cbp & mask) != 0 && !block(i)) {
+            reset_blocks();
+            return false;
         }
         mask >>= 1;
     }
@@ -357,207 +617,239 @@ void VideoDecoder::macroblock() {
     add_macroblock_to_frame();
     reset_blocks();
 
+    macroblock_decoded[macroblock_address] = true;
+
     if(macroblock_intra) {
         past_intra_address = macroblock_address;
     }
 
-    if(!macroblock_motion_forward) {
+    // A B-picture keeps the vector of a direction that isn't coded
+    if(!macroblock_motion_forward && picture_coding_type == PICTURE_TYPE_P) {
         recon_down_for_prev = recon_right_for_prev = 0;
     }
+
+    return true;
 }
 
-void VideoDecoder::predict_macroblock() {
+// Fails when a vector points outside the reference picture
+bool VideoDecoder::predict_macroblock() {
     mb_row = macroblock_address / mb_width;
     mb_col = macroblock_address % mb_width;
 
+    // Macroblocks of a P-picture without a forward vector have a zero one
+    bool forward = picture_coding_type == PICTURE_TYPE_P || macroblock_motion_forward;
+    bool backward = picture_coding_type == PICTURE_TYPE_B && macroblock_motion_backward;
+
+    if(forward && !predict_from(frame_forward, recon_right_for, recon_down_for, false)) {
+        return false;
+    }
+
+    // Bidirectional prediction averages both
+    if(backward && !predict_from(frame_backward, recon_right_back, recon_down_back, forward)) {
+        return false;
+    }
+
+    return true;
+}
+
+bool VideoDecoder::predict_from(Frame *reference, int recon_right, int recon_down, bool average) {
     // Compute motion vectors for luminance
-    int right_for = recon_right_for >> 1;
-    int down_for = recon_down_for >> 1;
+    int right = recon_right >> 1;
+    int down = recon_down >> 1;
+
+    int right_half = recon_right - 2 * right;
+    int down_half = recon_down - 2 * down;
+
+    // References can be read up to the edge of their last macroblocks
+    int stride = reference->stride;
+    int coded_height = reference->coded_height;
 
-    int right_half_for = recon_right_for - 2 * right_for;
-    int down_half_for = recon_down_for - 2 * down_for;
+    int top = mb_row * 16 + down;
+    int left = mb_col * 16 + right;
+    if(top < 0 || left < 0 || top + 15 + down_half >= coded_height || left + 15 + right_half >= stride) {
+        return false;
+    }
+
+    // Compute motion vectors for chrominance, in half pels of the chroma planes
+    int right_c = (recon_right/2) >> 1;
+    int down_c = (recon_down/2) >> 1;
 
-    // Compute motion vectors for chrominance
-    int right_for_c = (recon_right_for/2) >> 1;
-    int down_for_c = (recon_down_for/2) >> 1;
+    int right_half_c = recon_right/2 - 2 * right_c;
+    int down_half_c = recon_down/2 - 2 * down_c;
 
-    int right_half_for_c = recon_right_for/2 - 2 * right_for_c;
-    int down_half_for_c = recon_down_for/2 - 2 * down_for_c;
+    int chroma_stride = reference->chroma_stride;
+    int chroma_height = coded_height / 2;
+
+    int top_c = mb_row * 8 + down_c;
+    int left_c = mb_col * 8 + right_c;
+    if(top_c < 0 || left_c < 0 || top_c + 7 + down_half_c >= chroma_height || left_c + 7 + right_half_c >= chroma_stride) {
+        return false;
+    }
 
     for(int i = 0; i < 16; i++) {
         for(int j = 0; j < 16; j++) {
-            int row = (mb_row * 16) + i + down_for;
-            int col = (mb_col * 16) + j + right_for;
-            int index = (row - down_for) * width + (col - right_for);
+            int row = (mb_row * 16) + i + down;
+            int col = (mb_col * 16) + j + right;
+            int index = (row - down) * stride + (col - right);
 
-            copy_macroblock_into_frame(frame_current->y, frame_prev->y, index, row, col, right_half_for, down_half_for);
+            predict_pixel(frame_current->y, reference->y, stride, index, row, col, right_half, down_half, average);
+        }
+    }
 
-            row = mb_row * 16 + i + down_for_c;
-            col = mb_col * 16 + j + right_for_c;
-            index = (row - down_for_c) * width + (col - right_for_c);
+    for(int i = 0; i < 8; i++) {
+        for(int j = 0; j < 8; j++) {
+            int row = (mb_row * 8) + i + down_c;
+            int col = (mb_col * 8) + j + right_c;
+            int index = (row - down_c) * chroma_stride + (col - right_c);
 
-            copy_macroblock_into_frame(frame_current->cb, frame_prev->cb, index, row, col, right_half_for_c, down_half_for_c);
-            copy_macroblock_into_frame(frame_current->cr, frame_prev->cr, index, row, col, right_half_for_c, down_half_for_c);
+            predict_pixel(frame_current->cb, reference->cb, chroma_stride, index, row, col, right_half_c, down_half_c, average);
+            predict_pixel(frame_current->cr, reference->cr, chroma_stride, index, row, col, right_half_c, down_half_c, average);
         }
     }
+
+    return true;
 }
 
-void VideoDecoder::copy_macroblock_into_frame(uint8_t *dest, uint8_t *src, int index, int row, int col, int right, int down) {
-    if(!right && !down) {
-        dest[index] = src[row * width + col];   
-    }
+void VideoDecoder::predict_pixel(uint8_t *dest, uint8_t *src, int stride, int index, int row, int col, int right, int down, bool average) {
+    int value;
 
-    if(!right && down) {
-        dest[index] = (src[row * width + col] + src[(row + 1) * width + col]) / 2;
+    if(!right && !down) {
+        value = src[row * stride + col];
+    } else if(!right && down) {
+        value = (src[row * stride + col] + src[(row + 1) * stride + col]) / 2;
+    } else if(right && !down) {
+        value = (src[row * stride + col] + src[row * stride + (col + 1)]) / 2;
+    } else {
+        value = (src[row * stride + col] + 
+                 src[(row + 1) * stride + col] + 
+                 src[row * stride + (col + 1)] +
+                 src[(row + 1) * stride + (col + 1)]) / 4;
     }
 
-    if(right && !down) {
-        dest[index] = (src[row * width + col] + src[row * width + (col + 1)]) / 2;
+    if(average) {
+        value = (dest[index] + value + 1) / 2;
     }
 
-    if(right && down) {
-        dest[index] = (src[row * width + col] + 
-                       src[(row + 1) * width + col] + 
-                       src[row * width + (col + 1)] +
-                       src[(row + 1) * width + (col + 1)]) / 4;
-    }
+    dest[index] = value;
 }
 
+// Intra blocks replace the macroblock, the others are residuals added to its
+// prediction. The transform saturates to 0..255 as it writes.
 void VideoDecoder::add_macroblock_to_frame() {
     mb_row = macroblock_address / mb_width;
     mb_col = macroblock_address % mb_width;
 
-    for(int i = 0; i < 8; i++) {
-        for(int j = 0; j < 8; j++) {
-            int row = mb_row * 16 + i;
-            int col = mb_col * 16 + j;
-            if(macroblock_intra)
-                frame_current->y[row * width + col] = dct_recon[0][i*8 + j];
-            else
-                frame_current->y[row * width + col] += dct_recon[0][i*8 + j];
-
-            row = mb_row * 16 + i;
-            col = mb_col * 16 + j + 8;
-            if(macroblock_intra)
-                frame_current->y[row * width + col] = dct_recon[1][i*8 + j];
-            else
-                frame_current->y[row * width + col] += dct_recon[1][i*8 + j];
-
-            row = mb_row * 16 + i + 8;
-            col = mb_col * 16 + j;
-            if(macroblock_intra)
-                frame_current->y[row * width + col] = dct_recon[2][i*8 + j];
-            else
-                frame_current->y[row * width + col] += dct_recon[2][i*8 + j];
-
-            row = mb_row * 16 + i + 8;
-            col = mb_col * 16 + j + 8;
-            if(macroblock_intra)
-                frame_current->y[row * width + col] = dct_recon[3][i*8 + j];
-            else
-                frame_current->y[row * width + col] += dct_recon[3][i*8 + j];
-
-
-            for(int k = 0; k < 2; k++) {
-                for(int p = 0; p < 2; p++) {
-                    row = mb_row * 16 + i * 2 + k;
-                    col = mb_col * 16 + j * 2 + p;
-
-                    if(macroblock_intra)
-                        frame_current->cb[row * width + col] = dct_recon[4][i*8 + j];
-                    else
-                        frame_current->cb[row * width + col] += dct_recon[4][i*8 + j];
-
-
-                    if(macroblock_intra)
-                        frame_current->cr[row * width + col] = dct_recon[5][i*8 + j];
-                    else
-                        frame_current->cr[row * width + col] += dct_recon[5][i*8 + j];
-                }
-            }
+    bool add = !macroblock_intra;
+
+    int y_stride = frame_current->stride;
+    uint8_t *y = frame_current->y + (mb_row * 16) * y_stride + mb_col * 16;
+
+    // One chroma block covers the macroblock
+    int chroma_stride = frame_current->chroma_stride;
+    int chroma_index = (mb_row * 8) * chroma_stride + mb_col * 8;
+
+    uint8_t *dest[6] = {y, y + 8, y + 8 * y_stride, y + 8 * y_stride + 8,
+                        frame_current->cb + chroma_index, frame_current->cr + chroma_index};
+    int stride[6] = {y_stride, y_stride, y_stride, y_stride, chroma_stride, chroma_stride};
+
+    // Two blocks that need the full transform go through it together
+    for(int i = 0; i < 6; i += 2) {
+        if((coefficient_mask[i] & ~IDCT_TOP_LEFT_4X4) && (coefficient_mask[i + 1] & ~IDCT_TOP_LEFT_4X4)) {
+            idct_pair(dct_recon[i], dest[i], dest[i + 1], stride[i], add);
+        } else {
+            add_block_to_frame(i, dest[i], stride[i], add);
+            add_block_to_frame(i + 1, dest[i + 1], stride[i + 1], add);
         }
     }
 }
 
-void VideoDecoder::reconstruct_forward_motion_vectors() {
-    int complement_horizontal_forward_r;
-    int complement_vertical_forward_r;
-    int right_little;
-    int right_big;
-    int down_little;
-    int down_big;
-
-    if(forward_f == 1 || motion_horizontal_forward_code == 0) {
-        complement_horizontal_forward_r = 0;
-    } else {
-        complement_horizontal_forward_r = forward_f - 1 - motion_horizontal_forward_r;
+// The cheapest transform for the coefficients block() read
+void VideoDecoder::add_block_to_frame(int i, uint8_t *dest, int stride, bool add) {
+    if(last_coefficient[i] < 0 && add) {
+        return;
     }
 
-    if(forward_f == 1 || motion_vertical_forward_code == 0) {
-        complement_vertical_forward_r = 0;
+    if(last_coefficient[i] <= 0) {
+        idct_dc(dct_recon[i], dest, stride, add);
+    } else if((coefficient_mask[i] & ~IDCT_TOP_LEFT_4X4) == 0) {
+        idct_4x4(dct_recon[i], dest, stride, add);
     } else {
-        complement_vertical_forward_r = forward_f - 1 - motion_vertical_forward_r;
+        idct(dct_recon[i], dest, stride, add);
     }
+}
 
-    right_little = motion_horizontal_forward_code * forward_f;
-    if(right_little == 0) {
-        right_big = 0;
+// A vector component from its motion code and residual, relative to the
+// previous one (the prediction) and wrapped into the range of f
+static int reconstruct_motion_vector(int f, int code, int r, int prev) {
+    int complement_r;
+    if(f == 1 || code == 0) {
+        complement_r = 0;
     } else {
-        if(right_little > 0) {
-            right_little = right_little - complement_horizontal_forward_r;
-            right_big = right_little - 32 * forward_f;
-        } else {
-            right_little = right_little + complement_horizontal_forward_r;
-            right_big = right_little + 32 * forward_f;
-        }
+        complement_r = f - 1 - r;
     }
 
-    down_little = motion_vertical_forward_code * forward_f;
-    if(down_little == 0) {
-        down_big = 0;
+    int little = code * f;
+    int big;
+    if(little == 0) {
+        big = 0;
     } else {
-        if(down_little > 0) {
-            down_little = down_little - complement_vertical_forward_r;
-            down_big = down_little - 32 * forward_f;
+        if(little > 0) {
+            little = little - complement_r;
+            big = little - 32 * f;
         } else {
-            down_little = down_little + complement_vertical_forward_r;
-            down_big = down_little + 32 * forward_f;
+            little = little + complement_r;
+            big = little + 32 * f;
         }
     }
 
-    int max = (16 * forward_f) - 1;
-    int min = (-16 * forward_f);
+    int max = (16 * f) - 1;
+    int min = (-16 * f);
 
-    // Vector right
-    int new_vector = recon_right_for_prev + right_little;
+    int new_vector = prev + little;
     if(new_vector <= max && new_vector >= min) {
-        recon_right_for = recon_right_for_prev + right_little;
-    } else {
-        recon_right_for = recon_right_for_prev + right_big;
+        return prev + little;
     }
+
+    return prev + big;
+}
+
+void VideoDecoder::reconstruct_forward_motion_vectors() {
+    recon_right_for = reconstruct_motion_vector(forward_f, motion_horizontal_forward_code,
+                                                motion_horizontal_forward_r, recon_right_for_prev);
     recon_right_for_prev = recon_right_for;
 
-    // Vector down
-    new_vector = recon_down_for_prev + down_little;
-    if(new_vector <= max && new_vector >= min) {
-        recon_down_for = recon_down_for_prev + down_little;
-    } else {
-        recon_down_for = recon_down_for_prev + down_big;
-    }
+    recon_down_for = reconstruct_motion_vector(forward_f, motion_vertical_forward_code,
+                                               motion_vertical_forward_r, recon_down_for_prev);
     recon_down_for_prev = recon_down_for;
 
     if(full_pel_forward_vector) {
+        recon_right_for = recon_right_for << 1;
         recon_down_for = recon_down_for << 1;
     }
 }
 
-void VideoDecoder::block(int i) {
+void VideoDecoder::reconstruct_backward_motion_vectors() {
+    recon_right_back = reconstruct_motion_vector(backward_f, motion_horizontal_backward_code,
+                                                 motion_horizontal_backward_r, recon_right_back_prev);
+    recon_right_back_prev = recon_right_back;
+
+    recon_down_back = reconstruct_motion_vector(backward_f, motion_vertical_backward_code,
+                                                motion_vertical_backward_r, recon_down_back_prev);
+    recon_down_back_prev = recon_down_back;
+
+    if(full_pel_backward_vector) {
+        recon_right_back = recon_right_back << 1;
+        recon_down_back = recon_down_back << 1;
+    }
+}
+
+bool VideoDecoder::block(int i) {
     int index = 0;
     if(macroblock_intra) {
         if(i < 4) { // Luminance block
-            dct_dc_size_luminance = read_vlc(stream, DCT_SIZE_LUMINANCE);
+            dct_dc_size_luminance = read_vlc(slice_stream, &DCT_SIZE_LUMINANCE_LUT);
             if(dct_dc_size_luminance != 0) {
-                dct_dc_differential = stream->consume(dct_dc_size_luminance);
+                dct_dc_differential = slice_stream->consume_unchecked(dct_dc_size_luminance);
 
                 if(dct_dc_differential & (1 << (dct_dc_size_luminance - 1))) {
                     dct_zz[i][0] = dct_dc_differential;
@@ -566,9 +858,9 @@ void VideoDecoder::block(int i) {
                 }
             }
         } else {
-            dct_dc_size_chrominance = read_vlc(stream, DCT_SIZE_CHROMINANCE);
+            dct_dc_size_chrominance = read_vlc(slice_stream, &DCT_SIZE_CHROMINANCE_LUT);
             if(dct_dc_size_chrominance != 0) {
-                dct_dc_differential = stream->consume(dct_dc_size_chrominance);
+                dct_dc_differential = slice_stream->consume_unchecked(dct_dc_size_chrominance);
 
                 if(dct_dc_differential & (1 << (dct_dc_size_chrominance - 1))) {
                     dct_zz[i][0] = dct_dc_differential;
@@ -577,43 +869,52 @@ void VideoDecoder::block(int i) {
                 }
             }
         }
+
+        // The DC is predicted, it's there even when the differential is 0
+        last_coefficient[i] = 0;
+        coefficient_mask[i] = 1;
     
         index = 1;
     }
 
-    int level = 0;
+    // Run, signed level and end of block come from a single lookup
+    const VLC_TABLE *table = index == 0 ? &DCT_COEFF_FIRST_LUT : &DCT_COEFF_NEXT_LUT;
     while(true) {
-        int run = 0;
-        uint16_t coeff = read_vlc_uint(stream, DCT_COEFF);
+        VLC_LUT coeff = read_vlc_entry(slice_stream, table);
+        table = &DCT_COEFF_NEXT_LUT;
 
-        if((coeff == 0x0001) & (index > 0) && (stream->consume(1) == 0)) {
+        if(coeff.run == DCT_COEFF_END_OF_BLOCK) {
             break;
         }
 
-        if(coeff == 0xFFFF) { // Escape
-            run = stream->consume(6);
-            level = stream->consume(8);
+        int run = coeff.run;
+        int level = coeff.value;
+
+        if(coeff.run == DCT_COEFF_ESCAPE) {
+            run = slice_stream->consume_unchecked(6);
+            level = slice_stream->consume_unchecked(8);
 
             if(level == 0) {
-                level = stream->consume(8);
+                level = slice_stream->consume_unchecked(8);
             } else if(level == 128) {
-                level = stream->consume(8) - 256;
+                level = slice_stream->consume_unchecked(8) - 256;
             } else if(level > 128) {
                 level = level - 256;
             }
-        } else {
-            run = coeff >> 8;
-            level = coeff & 0xFF;
-
-            if(stream->consume(1)) {
-                level = -level;
-            }
         }
 
         index += run;
+        if(index > 63) { // Too many DCT coefficients
+            return false;
+        }
+
         dct_zz[i][index] = level;
+        last_coefficient[i] = index;
+        coefficient_mask[i] |= 1ULL << ZIG_ZAG_POSITION[index];
         index++;
     }
+
+    return true;
 }
 
 void VideoDecoder::print_block(int block) {
@@ -633,223 +934,6 @@ void VideoDecoder::decode_blocks() {
     } else {
         dequantize(false);
     }
-
-    inverse_discrete_cosine_transform();
-    clamp_blocks();
-}
-
-void VideoDecoder::clamp_blocks() {
-    for(int i = 0; i < 64; i++) {
-        for(int j = 0; j < 6; j++) {
-            if(dct_recon[j][i] > 255) {
-                dct_recon[j][i] = 255;
-            } else if(dct_recon[j][i] < 0) {
-                dct_recon[j][i] = 0;
-            }
-        }
-    }
-}
-
-void VideoDecoder::inverse_discrete_cosine_transform() {
-    static const float m0 = 2.0 * cos(1.0 / 16.0 * 2.0 * M_PI);
-    static const float m1 = 2.0 * cos(2.0 / 16.0 * 2.0 * M_PI);
-    static const float m3 = 2.0 * cos(2.0 / 16.0 * 2.0 * M_PI);
-    static const float m5 = 2.0 * cos(3.0 / 16.0 * 2.0 * M_PI);
-    static const float m2 = m0 - m5;
-    static const float m4 = m0 + m5;
-    static const float s0 = cos(0.0 / 16.0 * M_PI) / sqrt(8);
-    static const float s1 = cos(1.0 / 16.0 * M_PI) / 2.0;
-    static const float s2 = cos(2.0 / 16.0 * M_PI) / 2.0;
-    static const float s3 = cos(3.0 / 16.0 * M_PI) / 2.0;
-    static const float s4 = cos(4.0 / 16.0 * M_PI) / 2.0;
-    static const float s5 = cos(5.0 / 16.0 * M_PI) / 2.0;
-    static const float s6 = cos(6.0 / 16.0 * M_PI) / 2.0;
-    static const float s7 = cos(7.0 / 16.0 * M_PI) / 2.0;
-
-
-    for(int b = 0; b < 6; b++) {
-        int *block_component = dct_recon[b];
-        for (int k = 0; k < 8; ++k) {
-            const float g0 = block_component[0 * 8 + k] * s0;
-            const float g1 = block_component[4 * 8 + k] * s4;
-            const float g2 = block_component[2 * 8 + k] * s2;
-            const float g3 = block_component[6 * 8 + k] * s6;
-            const float g4 = block_component[5 * 8 + k] * s5;
-            const float g5 = block_component[1 * 8 + k] * s1;
-            const float g6 = block_component[7 * 8 + k] * s7;
-            const float g7 = block_component[3 * 8 + k] * s3;
-
-            const float f0 = g0;
-            const float f1 = g1;
-            const float f2 = g2;
-            const float f3 = g3;
-            const float f4 = g4 - g7;
-            const float f5 = g5 + g6;
-            const float f6 = g5 - g6;
-            const float f7 = g4 + g7;
-
-            const float e0 = f0;
-            const float e1 = f1;
-            const float e2 = f2 - f3;
-            const float e3 = f2 + f3;
-            const float e4 = f4;
-            const float e5 = f5 - f7;
-            const float e6 = f6;
-            const float e7 = f5 + f7;
-            const float e8 = f4 + f6;
-
-            const float d0 = e0;
-            const float d1 = e1;
-            const float d2 = e2 * m1;
-            const float d3 = e3;
-            const float d4 = e4 * m2;
-            const float d5 = e5 * m3;
-            const float d6 = e6 * m4;
-            const float d7 = e7;
-            const float d8 = e8 * m5;
-
-            const float c0 = d0 + d1;
-            const float c1 = d0 - d1;
-            const float c2 = d2 - d3;
-            const float c3 = d3;
-            const float c4 = d4 + d8;
-            const float c5 = d5 + d7;
-            const float c6 = d6 - d8;
-            const float c7 = d7;
-            const float c8 = c5 - c6;
-
-            const float b0 = c0 + c3;
-            const float b1 = c1 + c2;
-            const float b2 = c1 - c2;
-            const float b3 = c0 - c3;
-            const float b4 = c4 - c8;
-            const float b5 = c8;
-            const float b6 = c6 - c7;
-            const float b7 = c7;
-
-            block_component[0 * 8 + k] = b0 + b7;
-            block_component[1 * 8 + k] = b1 + b6;
-            block_component[2 * 8 + k] = b2 + b5;
-            block_component[3 * 8 + k] = b3 + b4;
-            block_component[4 * 8 + k] = b3 - b4;
-            block_component[5 * 8 + k] = b2 - b5;
-            block_component[6 * 8 + k] = b1 - b6;
-            block_component[7 * 8 + k] = b0 - b7;
-        }
-
-
-        for (int l = 0; l < 8; ++l) {
-            const float g0 = block_component[l * 8 + 0] * s0;
-            const float g1 = block_component[l * 8 + 4] * s4;
-            const float g2 = block_component[l * 8 + 2] * s2;
-            const float g3 = block_component[l * 8 + 6] * s6;
-            const float g4 = block_component[l * 8 + 5] * s5;
-            const float g5 = block_component[l * 8 + 1] * s1;
-            const float g6 = block_component[l * 8 + 7] * s7;
-            const float g7 = block_component[l * 8 + 3] * s3;
-
-            const float f0 = g0;
-            const float f1 = g1;
-            const float f2 = g2;
-            const float f3 = g3;
-            const float f4 = g4 - g7;
-            const float f5 = g5 + g6;
-            const float f6 = g5 - g6;
-            const float f7 = g4 + g7;
-
-            const float e0 = f0;
-            const float e1 = f1;
-            const float e2 = f2 - f3;
-            const float e3 = f2 + f3;
-            const float e4 = f4;
-            const float e5 = f5 - f7;
-            const float e6 = f6;
-            const float e7 = f5 + f7;
-            const float e8 = f4 + f6;
-
-            const float d0 = e0;
-            const float d1 = e1;
-            const float d2 = e2 * m1;
-            const float d3 = e3;
-            const float d4 = e4 * m2;
-            const float d5 = e5 * m3;
-            const float d6 = e6 * m4;
-            const float d7 = e7;
-            const float d8 = e8 * m5;
-
-            const float c0 = d0 + d1;
-            const float c1 = d0 - d1;
-            const float c2 = d2 - d3;
-            const float c3 = d3;
-            const float c4 = d4 + d8;
-            const float c5 = d5 + d7;
-            const float c6 = d6 - d8;
-            const float c7 = d7;
-            const float c8 = c5 - c6;
-
-            const float b0 = c0 + c3;
-            const float b1 = c1 + c2;
-            const float b2 = c1 - c2;
-            const float b3 = c0 - c3;
-            const float b4 = c4 - c8;
-            const float b5 = c8;
-            const float b6 = c6 - c7;
-            const float b7 = c7;
-
-            block_component[l * 8 + 0] = b0 + b7;
-            block_component[l * 8 + 1] = b1 + b6;
-            block_component[l * 8 + 2] = b2 + b5;
-            block_component[l * 8 + 3] = b3 + b4;
-            block_component[l * 8 + 4] = b3 - b4;
-            block_component[l * 8 + 5] = b2 - b5;
-            block_component[l * 8 + 6] = b1 - b6;
-            block_component[l * 8 + 7] = b0 - b7;
-        }
-    }
-
-
-    // double idct, cb, sum, cr;
-
-    // int output[8][8], gray_level;
-
-    // for(int b = 0; b < 6; b++) {        
-    //     for(int i = 0; i < 8; i++) {
-    //         for(int j = 0; j < 8; j++) {
-    //             sum = 0.0;
-
-    //             for(int u = 0; u < 8; u++) {
-    //                 for(int v = 0; v < 8; v++) {
-    //                     if(u == 0) {
-    //                         cb = 0.707106781;
-    //                     } else {
-    //                         cb = 1.0;
-    //                     }
-
-    //                     if(v == 0) {
-    //                         cr = 0.707106781;
-    //                     } else {
-    //                         cr = 1.0;
-    //                     }
-
-    //                     gray_level = dct_recon[b][u * 8 + v];
-    //                     idct = (gray_level * cb * cr * COS_DATA[i][u] * COS_DATA[j][v]);
-
-    //                     sum += idct;
-    //                 }
-    //             }
-
-    //             output[i][j] = (int)(0.25 * sum);
-    //         }
-    //     }
-
-    //     memset(dct_recon[b], 0, sizeof(int)*64);
-        
-    //     for(int k = 0; k < 8; k++) {
-    //         for(int l = 0; l < 8; l++) {
-    //             dct_recon[b][k * 8 + l] = output[k][l];
-    //         }
-    //     }
-    // }
 }
 
 void VideoDecoder::decode_intra_blocks() {
@@ -872,56 +956,72 @@ void VideoDecoder::decode_intra_blocks() {
     } 
 }
 
+// Coefficients block() didn't read stay 0
 void VideoDecoder::dequantize(bool intra) {
     int value;
     for(int i = 0; i < 6; i++) {
-    for(int m = 0; m < 8; m++) {
-        for(int n = 0; n < 8; n++) {
-            // for(int i = 0; i < 6; i++) {
-                int index = ZIG_ZAG[m][n];
-                if(intra) {
-                    value = (2 * dct_zz[i][index] * quantizer_scale * intra_quantizer_matrix[m][n]);
-                } else {
-                    value = (((2 * dct_zz[i][index]) + sign(dct_zz[i][index])) * quantizer_scale * non_intra_quantizer_matrix[m][n]);
-                }
-                dct_recon[i][m * 8 + n] = value >> 4;
+        for(uint64_t mask = coefficient_mask[i]; mask != 0; mask &= mask - 1) {
+            int position = __builtin_ctzll(mask);
+            int m = position / 8;
+            int n = position % 8;
+
+            int index = ZIG_ZAG[m][n];
+            if(intra) {
+                value = (2 * dct_zz[i][index] * quantizer_scale * intra_quantizer_matrix[m][n]);
+            } else {
+                value = (((2 * dct_zz[i][index]) + sign(dct_zz[i][index])) * quantizer_scale * non_intra_quantizer_matrix[m][n]);
+            }
+            int recon = value >> 4;
 
-                if((dct_recon[i][m * 8 + n] & 1) == 0) {
-                    dct_recon[i][m * 8 + n] = dct_recon[i][m * 8 + n] - sign(dct_recon[i][m * 8 + n]);
-                }
+            if((recon & 1) == 0) {
+                recon = recon - sign(recon);
+            }
 
-                if(dct_recon[i][m * 8 + n] > 2047) {
-                    dct_recon[i][m * 8 + n] = 2047;
-                }
+            if(recon > 2047) {
+                recon = 2047;
+            }
 
-                if(dct_recon[i][m * 8 + n] < -2048) {
-                    dct_recon[i][m * 8 + n] = -2048;
-                }
+            if(recon < -2048) {
+                recon = -2048;
+            }
 
-                if(!intra) {
-                    if(dct_zz[i][index] == 0) {
-                        dct_recon[i][m * 8 + n] = 0;
-                    }
+            if(!intra) {
+                if(dct_zz[i][index] == 0) {
+                    recon = 0;
                 }
             }
+
+            dct_recon[i][m * 8 + n] = recon;
         }
     }    
 }
 
 void VideoDecoder::reset_blocks() {
     memset(dct_zz, 0, sizeof(int)*6*64);
-    memset(dct_recon, 0, sizeof(int)*6*64);
+    memset(dct_recon, 0, sizeof(int16_t)*6*64);
+
+    for(int i = 0; i < 6; i++) {
+        last_coefficient[i] = -1;
+        coefficient_mask[i] = 0;
+    }
 }
 
-void VideoDecoder::frame_to_rgb(uint8_t *buffer) {
+// Chroma is only upsampled here, every sample covers 2x2 pixels. The
+// macroblock padding right and below the picture is cropped.
+void VideoDecoder::frame_to_rgb(Frame *frame, uint8_t *buffer) {
+    int width = frame->width;
+    int height = frame->height;
+    int stride = frame->stride;
+    int chroma_stride = frame->chroma_stride;
+
     double r,g,b,y,cb,cr;
     int index = 0;
 
     for(int i = 0; i < height; i++) {
         for(int j = 0; j < width; j++) {
-            y = (double)frame_current->y[i * width + j];
-            cb = (double)frame_current->cb[i * width + j];
-            cr = (double)frame_current->cr[i * width + j];
+            y = (double)frame->y[i * stride + j];
+            cb = (double)frame->cb[(i/2) * chroma_stride + j/2];
+            cr = (double)frame->cr[(i/2) * chroma_stride + j/2];
 
             r = y + 1.402 * (cr - 128.0);
             g = y - 0.34414 * (cb - 128.0) - 0.71414 * (cr - 128.0);
@@ -942,15 +1042,21 @@ void VideoDecoder::frame_to_rgb(uint8_t *buffer) {
     }
 }
 
-void VideoDecoder::frame_to_rgb(Mat *result) {
+// The display converts the frames itself, on its own thread
+void VideoDecoder::frame_to_rgb(const Frame *frame, Mat *result) {
+    int width = frame->width;
+    int height = frame->height;
+    int stride = frame->stride;
+    int chroma_stride = frame->chroma_stride;
+
     double r,g,b,y,cb,cr;
     int index = 0;
 
     for(int i = 0; i < height; i++) {
         for(int j = 0; j < width; j++) {
-            y = (double)frame_current->y[i * width + j];
-            cb = (double)frame_current->cb[i * width + j];
-            cr = (double)frame_current->cr[i * width + j];
+            y = (double)frame->y[i * stride + j];
+            cb = (double)frame->cb[(i/2) * chroma_stride + j/2];
+            cr = (double)frame->cr[(i/2) * chroma_stride + j/2];
 
             r = y + 1.402 * (cr - 128.0);
             g = y - 0.34414 * (cb - 128.0) - 0.71414 * (cr - 128.0);
@@ -971,11 +1077,11 @@ void VideoDecoder::frame_to_rgb(Mat *result) {
     }
 }
 
-void VideoDecoder::write_image() {
+void VideoDecoder::write_image(Frame *frame) {
     uint8_t* rgb_buffer = (uint8_t*)malloc(sizeof(uint8_t)*height*width*3);
     char png_name[16];
     
-    frame_to_rgb(rgb_buffer);
+    frame_to_rgb(frame, rgb_buffer);
     current_picture_nr++;
 
     sprintf(png_name, "./images/%06lu.png", current_picture_nr);
@@ -983,9 +1089,47 @@ void VideoDecoder::write_image() {
     stbi_write_png(png_name, width, height, 3, rgb_buffer, width*3);  
 }
 
-void VideoDecoder::add_frame_to_buffer() {
-    Mat *buffer = new Mat(height, width, CV_8UC3);
+// The PTS of the packet the picture start code (just read) is in, -1 when it
+// has none or an earlier picture started in it
+double VideoDecoder::picture_pts() {
+    if(!demuxer) {
+        return -1;
+    }
+
+    const MPEG1_PacketPosition *packet = demuxer->video_packet_at(stream->position() - 4);
+    if(!packet || packet->pts < 0 || packet->stream_position == pts_packet_position) {
+        return -1;
+    }
+
+    pts_packet_position = packet->stream_position;
+    return packet->pts;
+}
+
+// Pictures come here in display order
+void VideoDecoder::output_frame(Frame *frame) {
+    // Pictures before the seek target are only decoded as references
+    if(nr_of_frames_to_skip) {
+        nr_of_frames_to_skip--;
+        return;
+    }
+
+    add_frame_to_buffer(frame);
+    // write_image(frame);
+}
+
+void VideoDecoder::add_frame_to_buffer(Frame *frame) {
+    frame_pool->retain(frame);
 
-    frame_to_rgb(buffer);
-    display_buffer->push(buffer);
+    // A picture without a PTS is shown a frame period after the one before
+    double pts = frame->pts;
+    if(pts < 0) {
+        pts = last_pts < 0 ? 0 : last_pts + 1.0 / frame_rate;
+    }
+
+    last_pts = pts;
+
+    // Blocks while the display is behind, the frame is dropped once it stopped
+    if(!display_buffer->push({frame, pts})) {
+        frame_pool->release(frame);
+    }
 }
\ No newline at end of file
@@ -1,10 +1,14 @@
 #include "VLC.h"
-#include <queue>
+#include "SeekIndex.h"
+#include "FramePool.h"
+#include "DisplayQueue.h"
 #include <opencv2/opencv.hpp>
 
 using namespace std;
 using namespace cv;
 
+class Demuxer;
+
 static const double ASPECT_RATIO[] = {
     0,
     1.0000,  // VGA etc. 
@@ -46,6 +50,18 @@ static const int ZIG_ZAG[8][8] = {
     {35, 36, 48, 49, 57, 58, 62, 63}
 };
 
+// Raster position of each zig-zag index, the inverse of ZIG_ZAG
+static const uint8_t ZIG_ZAG_POSITION[64] = {
+     0,  1,  8, 16,  9,  2,  3, 10,
+    17, 24, 32, 25, 18, 11,  4,  5,
+    12, 19, 26, 33, 40, 48, 41, 34,
+    27, 20, 13,  6,  7, 14, 21, 28,
+    35, 42, 49, 56, 57, 50, 43, 36,
+    29, 22, 15, 23, 30, 37, 44, 51,
+    58, 59, 52, 45, 38, 31, 39, 46,
+    53, 60, 61, 54, 47, 55, 62, 63
+};
+
 static const uint8_t DEFAULT_INTRA_QUANTIZER_MATRIX[8][8] = {
     {8, 16, 19, 22, 26, 27, 29, 34},
     {16, 16, 22, 24, 27, 29, 34, 37}, 
@@ -68,72 +84,6 @@ static const uint8_t DEFAULT_NON_INTRA_QUANTIZER_MATRIX[] = {
     16, 16, 16, 16, 16, 16, 16, 16
 };
 
-static const VLC CODE_BLOCK_PATTERN[] = {
-    {  1 << 1,    0}, {  2 << 1,    0},  //   0: x
-    {  3 << 1,    0}, {  4 << 1,    0},  //   1: 0x
-    {  5 << 1,    0}, {  6 << 1,    0},  //   2: 1x
-    {  7 << 1,    0}, {  8 << 1,    0},  //   3: 00x
-    {  9 << 1,    0}, { 10 << 1,    0},  //   4: 01x
-    { 11 << 1,    0}, { 12 << 1,    0},  //   5: 10x
-    { 13 << 1,    0}, {       0,   60},  //   6: 11x
-    { 14 << 1,    0}, { 15 << 1,    0},  //   7: 000x
-    { 16 << 1,    0}, { 17 << 1,    0},  //   8: 001x
-    { 18 << 1,    0}, { 19 << 1,    0},  //   9: 010x
-    { 20 << 1,    0}, { 21 << 1,    0},  //  10: 011x
-    { 22 << 1,    0}, { 23 << 1,    0},  //  11: 100x
-    {       0,   32}, {       0,   16},  //  12: 101x
-    {       0,    8}, {       0,    4},  //  13: 110x
-    { 24 << 1,    0}, { 25 << 1,    0},  //  14: 0000x
-    { 26 << 1,    0}, { 27 << 1,    0},  //  15: 0001x
-    { 28 << 1,    0}, { 29 << 1,    0},  //  16: 0010x
-    { 30 << 1,    0}, { 31 << 1,    0},  //  17: 0011x
-    {       0,   62}, {       0,    2},  //  18: 0100x
-    {       0,   61}, {       0,    1},  //  19: 0101x
-    {       0,   56}, {       0,   52},  //  20: 0110x
-    {       0,   44}, {       0,   28},  //  21: 0111x
-    {       0,   40}, {       0,   20},  //  22: 1000x
-    {       0,   48}, {       0,   12},  //  23: 1001x
-    { 32 << 1,    0}, { 33 << 1,    0},  //  24: 0000 0x
-    { 34 << 1,    0}, { 35 << 1,    0},  //  25: 0000 1x
-    { 36 << 1,    0}, { 37 << 1,    0},  //  26: 0001 0x
-    { 38 << 1,    0}, { 39 << 1,    0},  //  27: 0001 1x
-    { 40 << 1,    0}, { 41 << 1,    0},  //  28: 0010 0x
-    { 42 << 1,    0}, { 43 << 1,    0},  //  29: 0010 1x
-    {       0,   63}, {       0,    3},  //  30: 0011 0x
-    {       0,   36}, {       0,   24},  //  31: 0011 1x
-    { 44 << 1,    0}, { 45 << 1,    0},  //  32: 0000 00x
-    { 46 << 1,    0}, { 47 << 1,    0},  //  33: 0000 01x
-    { 48 << 1,    0}, { 49 << 1,    0},  //  34: 0000 10x
-    { 50 << 1,    0}, { 51 << 1,    0},  //  35: 0000 11x
-    { 52 << 1,    0}, { 53 << 1,    0},  //  36: 0001 00x
-    { 54 << 1,    0}, { 55 << 1,    0},  //  37: 0001 01x
-    { 56 << 1,    0}, { 57 << 1,    0},  //  38: 0001 10x
-    { 58 << 1,    0}, { 59 << 1,    0},  //  39: 0001 11x
-    {       0,   34}, {       0,   18},  //  40: 0010 00x
-    {       0,   10}, {       0,    6},  //  41: 0010 01x
-    {       0,   33}, {       0,   17},  //  42: 0010 10x
-    {       0,    9}, {       0,    5},  //  43: 0010 11x
-    {      -1,    0}, { 60 << 1,    0},  //  44: 0000 000x
-    { 61 << 1,    0}, { 62 << 1,    0},  //  45: 0000 001x
-    {       0,   58}, {       0,   54},  //  46: 0000 010x
-    {       0,   46}, {       0,   30},  //  47: 0000 011x
-    {       0,   57}, {       0,   53},  //  48: 0000 100x
-    {       0,   45}, {       0,   29},  //  49: 0000 101x
-    {       0,   38}, {       0,   26},  //  50: 0000 110x
-    {       0,   37}, {       0,   25},  //  51: 0000 111x
-    {       0,   43}, {       0,   23},  //  52: 0001 000x
-    {       0,   51}, {       0,   15},  //  53: 0001 001x
-    {       0,   42}, {       0,   22},  //  54: 0001 010x
-    {       0,   50}, {       0,   14},  //  55: 0001 011x
-    {       0,   41}, {       0,   21},  //  56: 0001 100x
-    {       0,   49}, {       0,   13},  //  57: 0001 101x
-    {       0,   35}, {       0,   19},  //  58: 0001 110x
-    {       0,   11}, {       0,    7},  //  59: 0001 111x
-    {       0,   39}, {       0,   27},  //  60: 0000 0001x
-    {       0,   59}, {       0,   55},  //  61: 0000 0010x
-    {       0,   47}, {       0,   31},  //  62: 0000 0011x
-};
-
 static const double COS_DATA[8][8] = {
     1.000000,0.980785,0.923880,0.831470,0.707107,0.555570,0.382683,0.195090,
     1.000000,0.831470,0.382683,-0.195090,-0.707107,-0.980785,-0.923880,-0.555570,
@@ -145,49 +95,76 @@ static const double COS_DATA[8][8] = {
     1.000000,-0.980785,0.923880,-0.831470,0.707107,-0.555570,0.382683,-0.195090
 };
 
-typedef struct {
-    uint8_t *y;
-    uint8_t *cb;
-    uint8_t *cr;
-} Frame;
-
 class VideoDecoder {
 public:
-    VideoDecoder(BitStream*, queue<Mat *>*);
-
+    // Pictures are timed by the frame rate alone
+    VideoDecoder(BitStream*, DisplayQueue*);
+    // Decodes the video stream of the demuxer, pictures get the PTS of the
+    // packet their picture start code is in
+    VideoDecoder(Demuxer*, DisplayQueue*);
+
+    // Closes the display queue at the end of the stream. Stops early once the
+    // display closed it.
     void decode();
 
+    // Moves the demuxer to the GOP of entry, decode() then continues there
+    // with the dimensions and quantizer matrices of its sequence header.
+    // Pictures before seconds (from the first GOP, see SeekIndexEntry::time)
+    // are decoded but not shown, for a frame exact seek.
+    bool seek(const SeekIndexEntry*, double seconds);
+
+    void print_stats();
+
+    static void frame_to_rgb(const Frame*, Mat*);
+
+    // Damaged data is counted instead of stopping the decoder. Headers with
+    // forbidden values are skipped, a damaged slice is dropped from its first
+    // bad macroblock on and the macroblocks no slice decoded are concealed.
+    size_t picture_errors {0};
+    size_t slice_errors {0};
+    size_t concealed_macroblocks {0};
+
 private:
     void video_sequence();
-    void sequence_header();
+    bool sequence_header();
     void group_of_pictures();
     void picture();
     void slice();
-    void macroblock();
-    void block(int);
+    bool macroblock();
+    bool block(int);
+    void conceal_macroblocks();
 
-    void predict_macroblock();
+    bool predict_macroblock();
+    bool predict_from(Frame*, int recon_right, int recon_down, bool average);
+    void predict_pixel(uint8_t*, uint8_t*, int, int, int, int, int, int, bool);
     void add_macroblock_to_frame();
-    void copy_macroblock_into_frame(uint8_t*, uint8_t*, int, int, int, int, int);
+    void add_block_to_frame(int, uint8_t*, int, bool);
     void reconstruct_forward_motion_vectors();
+    void reconstruct_backward_motion_vectors();
 
     void reset_blocks();
     void decode_blocks();
     void print_block(int);
     void decode_intra_blocks();
-    void clamp_blocks();
-    void inverse_discrete_cosine_transform();
     void dequantize(bool);
 
     void init_frames();
-    void set_prev_frame();
-    void frame_to_rgb(uint8_t*);
-    void frame_to_rgb(Mat *result); 
-    void add_frame_to_buffer();
+    void frame_to_rgb(Frame*, uint8_t*);
+    void output_frame(Frame*);
+    void add_frame_to_buffer(Frame*);
+    double picture_pts();
 
-    void write_image();
+    void write_image(Frame*);
 
     BitStream *stream {nullptr};
+    Demuxer *demuxer {nullptr};
+
+    // The slice currently being decoded, slice_view when it can be read in
+    // place in stream and slice_copy when it has to be copied out of it
+    BitStream *slice_stream {nullptr};
+    BitStream *slice_view {nullptr};
+    BitStream *slice_copy {nullptr};
+    size_t slice_bits {0};
 
     int width {0};
     int height {0};
@@ -196,6 +173,7 @@ private:
     double aspect_ratio {0.0};
 
     int bit_rate {0};
+    int vbv_buffer_size {0};
 
     uint8_t intra_quantizer_matrix[8][8];
     uint8_t non_intra_quantizer_matrix[8][8];
@@ -203,8 +181,32 @@ private:
     int mb_width {0};
     int mb_height {0};
 
+    FramePool *frame_pool {nullptr};
+
+    // The picture being decoded
     Frame *frame_current {nullptr};
-    Frame *frame_prev {nullptr};
+
+    // The older and the newer reference (I- or P-) picture, both held. While
+    // a P-picture is decoded, frame_forward is the newer one and the picture
+    // itself is frame_backward.
+    Frame *frame_forward {nullptr};
+    Frame *frame_backward {nullptr};
+
+    // References decoded since the start or a seek, up to the 2 a B-picture needs
+    int nr_of_references {0};
+    // frame_backward is decoded but not shown yet
+    bool reference_pending {false};
+
+    // Which macroblocks of the current picture were decoded
+    bool *macroblock_decoded {nullptr};
+
+    // Decoded pictures still to be dropped after a seek
+    size_t nr_of_frames_to_skip {0};
+
+    // Group of pictures header
+    uint32_t time_code {0};
+    bool closed_gop {false};
+    bool broken_link {false};
 
     uint8_t picture_coding_type {0};
 
@@ -255,8 +257,27 @@ private:
     int motion_vertical_forward_code {0};
     int motion_vertical_forward_r {0};
 
+    int recon_right_back {0};
+    int recon_down_back {0};
+
+    int recon_right_back_prev {0};
+    int recon_down_back_prev {0};
+
+    int motion_horizontal_backward_code {0};
+    int motion_horizontal_backward_r {0};
+
+    int motion_vertical_backward_code {0};
+    int motion_vertical_backward_r {0};
+
     int dct_zz[6][64];
-    int dct_recon[6][64];
+    // Dequantized coefficients, transformed two consecutive blocks at a time
+    int16_t dct_recon[6][64];
+
+    // Zig-zag index of the last coefficient block() read, -1 for none, and
+    // the raster positions of all of them. Only those are dequantized and
+    // they pick the transform.
+    int last_coefficient[6];
+    uint64_t coefficient_mask[6];
 
     int dct_dc_size_luminance {0};
     int dct_dc_size_chrominance {0};
@@ -264,5 +285,11 @@ private:
 
     size_t current_picture_nr {0};
 
-    queue<Mat *> *display_buffer {nullptr};
+    DisplayQueue *display_buffer {nullptr};
+
+    // Stream position of the packet whose PTS was given to a picture last,
+    // a PTS belongs to the first picture that starts in its packet
+    size_t pts_packet_position {(size_t)-1};
+    // Of the last frame added to display_buffer
+    double last_pts {-1};
 };
\ No newline at end of file
@@ -0,0 +1,293 @@
+// Inverse DCT cost per block
+//
+//   idct_benchmark
+//
+// Checks the accuracy of the scalar kernel with the IEEE 1180-1990 test and
+// fails (exit code 1) when it exceeds one of its limits. Then transforms a
+// set of generated blocks (a few low frequency coefficients up to fully coded
+// ones) with each kernel, putting them into and adding them to a picture. The
+// sparse kernels get blocks with only a DC coefficient or only the top left
+// 4x4. Checks that every kernel matches the full scalar one exactly and
+// reports the cycles (time stamp counter ticks, nanoseconds off x86) per
+// block.
+
+#include "../IDCT.h"
+
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+
+#ifdef IDCT_HAS_X86
+#include <x86intrin.h>
+#endif
+
+#define NR_OF_BLOCKS                        4096
+#define PICTURE_STRIDE                      (64 * 8)
+#define MIN_BENCHMARK_BLOCKS                (64LL * 1024 * 1024)
+
+// IEEE 1180 blocks per input range and sign, and its limits
+#define IEEE1180_BLOCKS                     10000
+#define IEEE1180_PEAK_ERROR                 1
+#define IEEE1180_PIXEL_MSE                  0.06
+#define IEEE1180_OVERALL_MSE                0.02
+#define IEEE1180_PIXEL_MEAN_ERROR           0.015
+#define IEEE1180_OVERALL_MEAN_ERROR         0.0015
+
+static uint32_t random_state = 0x12345678;
+
+static uint32_t next_random() {
+    random_state = random_state * 1664525 + 1013904223;
+    return random_state >> 8;
+}
+
+// Coefficients up to a random diagonal (at most max_diagonal) within the top
+// left size x size, larger towards the DC like coded blocks have them
+static std::vector<int16_t> generate_blocks(int max_diagonal, int size) {
+    std::vector<int16_t> blocks(NR_OF_BLOCKS * 64, 0);
+
+    for(int b = 0; b < NR_OF_BLOCKS; b++) {
+        int16_t *block = &blocks[b * 64];
+        int diagonal = next_random() % (max_diagonal + 1);
+
+        for(int i = 0; i < size; i++) {
+            for(int j = 0; i + j <= diagonal && j < size; j++) {
+                if(i + j > 0 && next_random() % 3 != 0) {
+                    continue;
+                }
+
+                int range = 2048 >> (i + j) / 2;
+                block[i * 8 + j] = (int)(next_random() % (2 * range)) - range;
+            }
+        }
+    }
+
+    return blocks;
+}
+
+static double dct_basis(int x, int u) {
+    return (u == 0 ? M_SQRT1_2 : 1.0) * cos((2 * x + 1) * u * M_PI / 16);
+}
+
+// The transforms by their definition, before rounding
+static void fdct_reference(const int *pixels, double *out) {
+    for(int u = 0; u < 8; u++) {
+        for(int v = 0; v < 8; v++) {
+            double sum = 0.0;
+            for(int x = 0; x < 8; x++) {
+                for(int y = 0; y < 8; y++) {
+                    sum += pixels[x * 8 + y] * dct_basis(x, u) * dct_basis(y, v);
+                }
+            }
+            out[u * 8 + v] = sum / 4;
+        }
+    }
+}
+
+static void idct_reference(const int16_t *block, double *out) {
+    for(int x = 0; x < 8; x++) {
+        for(int y = 0; y < 8; y++) {
+            double sum = 0.0;
+            for(int u = 0; u < 8; u++) {
+                for(int v = 0; v < 8; v++) {
+                    sum += block[u * 8 + v] * dct_basis(x, u) * dct_basis(y, v);
+                }
+            }
+            out[x * 8 + y] = sum / 4;
+        }
+    }
+}
+
+static int clip(double value, int low, int high) {
+    long rounded = (long)floor(value + 0.5);
+    return rounded > high ? high : rounded < low ? low : rounded;
+}
+
+// The random numbers of the IEEE 1180 test, in low..high
+static int ieee1180_random(long *state, int low, int high) {
+    *state = (*state * 1103515245) + 12345;
+    int i = *state & 0x7FFFFFFE;
+    double x = (double)i / 0x7FFFFFFF * (high - low + 1);
+    return (int)x + low;
+}
+
+// Random pixels in -low..high (times sign) through the forward transform,
+// rounded and clipped to coefficients. Their transform back is compared with
+// the double precision one, both clipped to -256..255.
+static bool ieee1180_test(int low, int high, int sign) {
+    long state = 1;
+
+    int peak_error = 0;
+    long sum_error[64] = {0};
+    long sum_squared_error[64] = {0};
+
+    for(int b = 0; b < IEEE1180_BLOCKS; b++) {
+        int pixels[64];
+        for(int i = 0; i < 64; i++) {
+            pixels[i] = ieee1180_random(&state, -low, high) * sign;
+        }
+
+        double coefficients[64];
+        fdct_reference(pixels, coefficients);
+
+        int16_t block[64];
+        for(int i = 0; i < 64; i++) {
+            block[i] = clip(coefficients[i], -2048, 2047);
+        }
+
+        double reference[64];
+        idct_reference(block, reference);
+
+        int16_t result[64];
+        idct_scalar_int16(block, result);
+
+        for(int i = 0; i < 64; i++) {
+            int error = clip(result[i], -256, 255) - clip(reference[i], -256, 255);
+            peak_error = abs(error) > peak_error ? abs(error) : peak_error;
+            sum_error[i] += error;
+            sum_squared_error[i] += error * error;
+        }
+    }
+
+    double pixel_mse = 0.0, pixel_mean_error = 0.0;
+    double overall_mse = 0.0, overall_mean_error = 0.0;
+    for(int i = 0; i < 64; i++) {
+        double mse = (double)sum_squared_error[i] / IEEE1180_BLOCKS;
+        double mean_error = (double)sum_error[i] / IEEE1180_BLOCKS;
+
+        pixel_mse = mse > pixel_mse ? mse : pixel_mse;
+        pixel_mean_error = fabs(mean_error) > pixel_mean_error ? fabs(mean_error) : pixel_mean_error;
+        overall_mse += mse / 64;
+        overall_mean_error += mean_error / 64;
+    }
+
+    bool passed = peak_error <= IEEE1180_PEAK_ERROR &&
+                  pixel_mse <= IEEE1180_PIXEL_MSE && overall_mse <= IEEE1180_OVERALL_MSE &&
+                  pixel_mean_error <= IEEE1180_PIXEL_MEAN_ERROR && fabs(overall_mean_error) <= IEEE1180_OVERALL_MEAN_ERROR;
+
+    printf("IEEE 1180 -%d..%d %s: peak error %d, pixel mse %.4f, overall mse %.4f, pixel mean error %.4f, overall mean error %.5f%s\n",
+           low, high, sign > 0 ? "+" : "-", peak_error, pixel_mse, overall_mse,
+           pixel_mean_error, overall_mean_error, passed ? "" : " FAILED");
+    return passed;
+}
+
+static bool check_accuracy() {
+    bool passed = true;
+    for(int sign = 1; sign >= -1; sign -= 2) {
+        passed &= ieee1180_test(256, 255, sign);
+        passed &= ieee1180_test(5, 5, sign);
+        passed &= ieee1180_test(300, 300, sign);
+    }
+
+    // All zero coefficients have to give all zero pixels
+    int16_t zero[64] = {0};
+    int16_t result[64];
+    idct_scalar_int16(zero, result);
+    for(int i = 0; i < 64; i++) {
+        if(result[i] != 0) {
+            printf("IEEE 1180: zero input gives a nonzero output FAILED\n");
+            return false;
+        }
+    }
+
+    return passed;
+}
+
+// Every block into its own 8x8 of the picture, the kernels write the same bytes
+static void transform_all(idct_pair_kernel kernel, const std::vector<int16_t> &blocks, std::vector<uint8_t> &picture, bool add) {
+    for(int b = 0; b < NR_OF_BLOCKS; b += 2) {
+        uint8_t *dest = &picture[(b / 64) * 8 * PICTURE_STRIDE + (b % 64) * 8];
+        kernel(&blocks[b * 64], dest, dest + 8, PICTURE_STRIDE, add);
+    }
+}
+
+static void transform_all(idct_kernel kernel, const std::vector<int16_t> &blocks, std::vector<uint8_t> &picture, bool add) {
+    for(int b = 0; b < NR_OF_BLOCKS; b++) {
+        uint8_t *dest = &picture[(b / 64) * 8 * PICTURE_STRIDE + (b % 64) * 8];
+        kernel(&blocks[b * 64], dest, PICTURE_STRIDE, add);
+    }
+}
+
+static std::vector<uint8_t> initial_picture() {
+    std::vector<uint8_t> picture((size_t)(NR_OF_BLOCKS / 64) * 8 * PICTURE_STRIDE);
+    for(size_t i = 0; i < picture.size(); i++) {
+        picture[i] = next_random() & 0xFF;
+    }
+
+    return picture;
+}
+
+static uint64_t ticks() {
+#ifdef IDCT_HAS_X86
+    return __rdtsc();
+#else
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+#endif
+}
+
+template<typename Kernel>
+static void run(const char *name, Kernel kernel, const std::vector<int16_t> &blocks, bool add) {
+    std::vector<uint8_t> start = initial_picture();
+
+    // Warm up and compare with the reference
+    std::vector<uint8_t> expected = start;
+    std::vector<uint8_t> picture = start;
+    transform_all(idct_pair_scalar, blocks, expected, add);
+    transform_all(kernel, blocks, picture, add);
+
+    if(picture != expected) {
+        fprintf(stderr, "%s: differs from the scalar kernel\n", name);
+        exit(1);
+    }
+
+    int iterations = (int)(MIN_BENCHMARK_BLOCKS / NR_OF_BLOCKS);
+
+    uint64_t t1 = ticks();
+    for(int i = 0; i < iterations; i++) {
+        transform_all(kernel, blocks, picture, add);
+    }
+    uint64_t t2 = ticks();
+
+    double per_block = (double)(t2 - t1) / ((double)iterations * NR_OF_BLOCKS);
+    printf("%-10s %-4s %8.1f %s/block\n", name, add ? "add" : "put", per_block,
+#ifdef IDCT_HAS_X86
+           "cycles"
+#else
+           "ns"
+#endif
+    );
+}
+
+int main() {
+    std::vector<int16_t> blocks = generate_blocks(14, 8);
+    std::vector<int16_t> blocks_4x4 = generate_blocks(6, 4);
+    std::vector<int16_t> blocks_dc = generate_blocks(0, 1);
+
+    if(!check_accuracy()) {
+        return 1;
+    }
+
+    for(int add = 0; add < 2; add++) {
+        run("scalar", idct_pair_scalar, blocks, add);
+
+#ifdef IDCT_HAS_X86
+        run("sse2", idct_pair_sse2, blocks, add);
+        if(idct_has_avx2()) {
+            run("avx2", idct_pair_avx2, blocks, add);
+        }
+#endif
+
+        run("4x4", idct_4x4_scalar, blocks_4x4, add);
+#ifdef IDCT_HAS_X86
+        run("4x4 sse2", idct_4x4_sse2, blocks_4x4, add);
+#endif
+        run("dc", idct_dc_scalar, blocks_dc, add);
+#ifdef IDCT_HAS_X86
+        run("dc sse2", idct_dc_sse2, blocks_dc, add);
+#endif
+    }
+
+    return 0;
+}
@@ -0,0 +1,132 @@
+// Start code scan throughput
+//
+//   start_code_benchmark [file.mpg]
+//
+// Counts every 00 00 01 prefix in the file (or in a generated 256 MiB buffer
+// when no file is given) with each scanner and reports the scan rate in GB/s.
+
+#include "../StartCode.h"
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+
+#define GENERATED_SIZE                      (256 * 1024 * 1024)
+#define GENERATED_PACKET_SIZE               2048
+#define MIN_BENCHMARK_BYTES                 (2048LL * 1024 * 1024)
+
+// The loop next_start_code used before the vectorized scanners
+static const uint8_t* find_start_code_bytewise(const uint8_t *begin, const uint8_t *end) {
+    for(const uint8_t *p = begin; end - p >= 3; p++) {
+        if(p[0] == 0x00 && p[1] == 0x00 && p[2] == 0x01) {
+            return p;
+        }
+    }
+
+    return end;
+}
+
+static std::vector<uint8_t> load_file(const char *path) {
+    std::vector<uint8_t> buffer;
+
+    FILE *fp = fopen(path, "rb");
+    if(!fp) {
+        fprintf(stderr, "Unable to open %s\n", path);
+        exit(1);
+    }
+
+    fseek(fp, 0, SEEK_END);
+    buffer.resize(ftell(fp));
+    fseek(fp, 0, SEEK_SET);
+
+    if(fread(buffer.data(), 1, buffer.size(), fp) != buffer.size()) {
+        fprintf(stderr, "Unable to read %s\n", path);
+        exit(1);
+    }
+
+    fclose(fp);
+    return buffer;
+}
+
+// Random bytes with a start code at the beginning of every packet, roughly
+// what a program stream with 2 KiB packets looks like to the scanner
+static std::vector<uint8_t> generate_buffer() {
+    std::vector<uint8_t> buffer(GENERATED_SIZE);
+
+    uint32_t state = 0x12345678;
+    for(size_t i = 0; i < buffer.size(); i++) {
+        state = state * 1664525 + 1013904223;
+        buffer[i] = state >> 24;
+    }
+
+    for(size_t i = 0; i + 4 <= buffer.size(); i += GENERATED_PACKET_SIZE) {
+        buffer[i] = 0x00;
+        buffer[i + 1] = 0x00;
+        buffer[i + 2] = 0x01;
+        buffer[i + 3] = 0xE0;
+    }
+
+    return buffer;
+}
+
+static size_t count_start_codes(start_code_scanner scanner, const std::vector<uint8_t> &buffer) {
+    const uint8_t *p = buffer.data();
+    const uint8_t *end = p + buffer.size();
+
+    size_t count = 0;
+    while((p = scanner(p, end)) != end) {
+        count++;
+        p += 3;
+    }
+
+    return count;
+}
+
+static void run(const char *name, start_code_scanner scanner, const std::vector<uint8_t> &buffer) {
+    using std::chrono::high_resolution_clock;
+    using std::chrono::duration;
+
+    // Warm up and establish the expected count
+    size_t count = count_start_codes(scanner, buffer);
+
+    int iterations = (int)(MIN_BENCHMARK_BYTES / (long long)buffer.size()) + 1;
+
+    auto t1 = high_resolution_clock::now();
+    for(int i = 0; i < iterations; i++) {
+        if(count_start_codes(scanner, buffer) != count) {
+            fprintf(stderr, "%s: inconsistent result\n", name);
+            exit(1);
+        }
+    }
+    auto t2 = high_resolution_clock::now();
+
+    duration<double> seconds = t2 - t1;
+    double gb_per_second = (double)buffer.size() * iterations / seconds.count() / 1e9;
+
+    printf("%-10s %10zu start codes %8.2f GB/s\n", name, count, gb_per_second);
+}
+
+int main(int argc, char **argv) {
+    std::vector<uint8_t> buffer = argc > 1 ? load_file(argv[1]) : generate_buffer();
+
+    if(buffer.size() < 4) {
+        fputs("Input is too small\n", stderr);
+        return 1;
+    }
+
+    printf("Scanning %zu bytes\n", buffer.size());
+
+    run("bytewise", find_start_code_bytewise, buffer);
+    run("scalar", find_start_code_scalar, buffer);
+
+#ifdef START_CODE_HAS_X86
+    run("sse2", find_start_code_sse2, buffer);
+    if(start_code_has_avx2()) {
+        run("avx2", find_start_code_avx2, buffer);
+    }
+#endif
+
+    return 0;
+}
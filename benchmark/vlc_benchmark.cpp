@@ -0,0 +1,202 @@
+// VLC decode throughput
+//
+//   vlc_benchmark video.mpg
+//
+// Collects the slices of the video stream and decodes their bits as a run of
+// DCT coefficient codes (sign bits, escapes and end of block included): by
+// walking the tree one bit at a time, through the DCT_COEFF lookup table and
+// through the fused run/level table. Reports the rate in symbols per second. The slices aren't parsed, so the codes only
+// follow the bit statistics of real coded data.
+
+#include "../Demuxer.h"
+#include "../VLC.h"
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+
+#define SLICE_CODE_START                    0x01
+#define SLICE_CODE_END                      0xAF
+
+#define MIN_BENCHMARK_BITS                  (1024LL * 1024 * 1024)
+
+// Reads one coefficient the way VideoDecoder::block does after the first,
+// returns false at the end of a block
+typedef bool (*coeff_reader)(BitStream*, int *run, int *level);
+
+static void read_escape(BitStream *stream, int *run, int *level) {
+    *run = stream->consume_unchecked(6);
+    *level = stream->consume_unchecked(8);
+
+    if(*level == 0) {
+        *level = stream->consume_unchecked(8);
+    } else if(*level == 128) {
+        *level = stream->consume_unchecked(8) - 256;
+    } else if(*level > 128) {
+        *level = *level - 256;
+    }
+}
+
+// Unpacks a DCT_COEFF value, reading the sign and end of block bits separately
+static bool unpack_coeff(BitStream *stream, uint16_t coeff, int *run, int *level) {
+    if(coeff == 0x0001 && stream->consume_unchecked(1) == 0) {
+        return false;
+    }
+
+    if(coeff == 0xFFFF) {
+        read_escape(stream, run, level);
+        return true;
+    }
+
+    // Invalid code, no sign follows
+    if(coeff == 0) {
+        *run = 0;
+        *level = 0;
+        return true;
+    }
+
+    *run = coeff >> 8;
+    *level = coeff & 0xFF;
+    if(stream->consume_unchecked(1)) {
+        *level = -*level;
+    }
+
+    return true;
+}
+
+// How read_vlc decoded before the lookup tables
+static bool read_coeff_tree(BitStream *stream, int *run, int *level) {
+    VLC state = {0, 0};
+    do {
+        state = DCT_COEFF[state.index + stream->consume_unchecked(1)];
+    } while(state.index > 0);
+
+    return unpack_coeff(stream, (uint16_t)state.value, run, level);
+}
+
+static bool read_coeff_lut(BitStream *stream, int *run, int *level) {
+    return unpack_coeff(stream, read_vlc_uint(stream, &DCT_COEFF_LUT), run, level);
+}
+
+// Run, signed level and end of block from one lookup
+static bool read_coeff_fused(BitStream *stream, int *run, int *level) {
+    VLC_LUT coeff = read_vlc_entry(stream, &DCT_COEFF_NEXT_LUT);
+
+    if(coeff.run == DCT_COEFF_END_OF_BLOCK) {
+        return false;
+    }
+
+    if(coeff.run == DCT_COEFF_ESCAPE) {
+        read_escape(stream, run, level);
+        return true;
+    }
+
+    *run = coeff.run;
+    *level = coeff.value;
+    return true;
+}
+
+// Copies the payload of every slice in the video stream into one buffer
+static std::vector<uint8_t> load_slices(const char *path, size_t *nr_of_slices) {
+    std::vector<uint8_t> slices;
+    *nr_of_slices = 0;
+
+    Demuxer demuxer(path);
+    BitStream *stream = demuxer.video_stream;
+    BitStream slice;
+
+    stream->next_start_code();
+    while(stream->start_code != -1) {
+        if(stream->start_code < SLICE_CODE_START || stream->start_code > SLICE_CODE_END) {
+            stream->next_start_code();
+            continue;
+        }
+
+        stream->copy_until_start_code(&slice);
+        slices.insert(slices.end(), slice.data, slice.data + slice.size);
+        (*nr_of_slices)++;
+
+        stream->next_start_code();
+    }
+
+    return slices;
+}
+
+static size_t decode_coeffs(coeff_reader reader, const std::vector<uint8_t> &slices, uint64_t *checksum) {
+    BitStream stream;
+    memcpy(stream.reserve(slices.size()), slices.data(), slices.size());
+    stream.commit(slices.size());
+
+    size_t end = slices.size() << 3;
+    size_t nr_of_symbols = 0;
+
+    while(stream.bit_index < end) {
+        int run = 0;
+        int level = 0;
+
+        if(!reader(&stream, &run, &level)) {
+            run = 64;
+        }
+
+        *checksum = *checksum * 31 + (run << 16) + level;
+        nr_of_symbols++;
+    }
+
+    return nr_of_symbols;
+}
+
+static void run(const char *name, coeff_reader reader, const std::vector<uint8_t> &slices, uint64_t *expected) {
+    using std::chrono::high_resolution_clock;
+    using std::chrono::duration;
+
+    // Warm up and check that every decoder reads the same codes
+    uint64_t checksum = 0;
+    size_t nr_of_symbols = decode_coeffs(reader, slices, &checksum);
+
+    if(*expected == 0) {
+        *expected = checksum;
+    } else if(checksum != *expected) {
+        fprintf(stderr, "%s: decoded different symbols\n", name);
+        exit(1);
+    }
+
+    int iterations = (int)(MIN_BENCHMARK_BITS / (long long)(slices.size() << 3)) + 1;
+
+    double seconds = 0;
+    for(int i = 0; i < iterations; i++) {
+        auto t1 = high_resolution_clock::now();
+        decode_coeffs(reader, slices, &checksum);
+        auto t2 = high_resolution_clock::now();
+
+        seconds += duration<double>(t2 - t1).count();
+    }
+
+    double symbols_per_second = (double)nr_of_symbols * iterations / seconds;
+
+    printf("%-6s %10zu symbols %8.1f M symbols/s\n", name, nr_of_symbols, symbols_per_second / 1e6);
+}
+
+int main(int argc, char **argv) {
+    if(argc < 2) {
+        fputs("Usage: vlc_benchmark video.mpg\n", stderr);
+        return 1;
+    }
+
+    size_t nr_of_slices;
+    std::vector<uint8_t> slices = load_slices(argv[1], &nr_of_slices);
+
+    if(slices.empty()) {
+        fputs("No slices found\n", stderr);
+        return 1;
+    }
+
+    printf("Decoding %zu bytes of %zu slices\n", slices.size(), nr_of_slices);
+
+    uint64_t expected = 0;
+    run("tree", read_coeff_tree, slices, &expected);
+    run("lut", read_coeff_lut, slices, &expected);
+    run("fused", read_coeff_fused, slices, &expected);
+
+    return 0;
+}
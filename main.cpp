@@ -1,6 +1,11 @@
 #include "Demuxer.h"
+#include "VideoDecoder.h"
+#include "AudioDecoder.h"
+#include "SeekIndex.h"
 
+#include <chrono>
 #include <pthread.h>
+#include <string.h>
 #include <unistd.h>
 
 #include <opencv2/highgui/highgui_c.h>
@@ -8,61 +13,212 @@
 using namespace std;
 using namespace cv;
 
-typedef struct {
-	BitStream *input_stream;
-	queue<Mat *> *video_buffer;
-} VideoThreadArgs;
-
 void* decode_video_thread(void*);
+void* decode_audio_thread(void*);
+
+static void usage() {
+	fputs("Usage: mpeg1_player [-a audio.wav|null] [-n] [-i] [-s seconds] [-V video_id] [-A audio_id] video.mpg\n", stderr);
+	exit(1);
+}
 
 int main(int argc, char** argv) {
+	const char *audio_output = nullptr;
+	bool play_video = true;
+	bool build_index = false;
+	double seek_time = -1;
+	int video_stream_id = DEMUXER_FIRST_STREAM;
+	int audio_stream_id = DEMUXER_FIRST_STREAM;
+
+	int option;
+	while((option = getopt(argc, argv, "a:nis:V:A:")) != -1) {
+		switch(option) {
+			case 'a':
+				audio_output = optarg;
+				break;
+			case 'n':
+				play_video = false;
+				break;
+			case 'i':
+				build_index = true;
+				break;
+			case 's':
+				seek_time = atof(optarg);
+				break;
+			case 'V':
+				video_stream_id = strtol(optarg, NULL, 0);
+				break;
+			case 'A':
+				audio_stream_id = strtol(optarg, NULL, 0);
+				break;
+			default:
+				usage();
+		}
+	}
+
+	if(optind >= argc || (!play_video && !audio_output && !build_index)) {
+		usage();
+	}
+
+	const char *file = argv[optind];
+
+	// Writes (or refreshes) the seek index sidecar
+	if(build_index) {
+		SeekIndex index;
+		if(!index.open(file)) {
+			fprintf(stderr, "Unable to index %s\n", file);
+			exit(1);
+		}
+
+		printf("Indexed %lu GOPs and I-pictures of %s\n", index.nr_of_entries, file);
+		return 0;
+	}
+
 	printf("MPEG1 player\n");
-	printf("Playing %s\n", argv[1]);
+	printf("Playing %s\n", file);
+
+	// Seeking goes through the index, built on the first seek into a file
+	SeekIndex index;
+	const SeekIndexEntry *seek_entry = nullptr;
+
+	if(seek_time >= 0) {
+		if(strcmp(file, "-") == 0 || !index.open(file) || !(seek_entry = index.find(seek_time))) {
+			fprintf(stderr, "Unable to seek in %s\n", file);
+			exit(1);
+		}
+	}
+
+	// Audio gets a demuxer of its own on its own thread, so it shares nothing
+	// with the video thread. Both read the mapped file in place.
+	AudioDecoder *audio_decoder = nullptr;
+	pthread_t audio_thread;
+
+	if(audio_output) {
+		if(play_video && strcmp(file, "-") == 0) {
+			fputs("Audio can only be decoded from stdin without video (-n)\n", stderr);
+			exit(1);
+		}
+
+		AudioSink *audio_sink;
+		if(strcmp(audio_output, "null") == 0) {
+			audio_sink = new NullSink();
+		} else {
+			auto wav_sink = new WavSink(audio_output);
+			if(!wav_sink->is_open()) {
+				fprintf(stderr, "Unable to open %s\n", audio_output);
+				exit(1);
+			}
+
+			audio_sink = wav_sink;
+		}
+
+		Demuxer *audio_demuxer = new Demuxer(file);
+		audio_demuxer->video_stream_id = DEMUXER_NO_STREAM;
+		audio_demuxer->audio_stream_id = audio_stream_id;
+
+		// Muxers interleave by time, the audio packets next to the GOP are
+		// close enough to it
+		if(seek_entry) {
+			audio_demuxer->seek(seek_entry->offset);
+		}
+
+		audio_decoder = new AudioDecoder(audio_demuxer->audio_stream, audio_sink);
+		pthread_create(&audio_thread, NULL, decode_audio_thread, (void*)audio_decoder);
+	}
 
-	queue<Mat *> *display_buffer = new queue<Mat *>();
+	if(!play_video) {
+		pthread_join(audio_thread, NULL);
+		audio_decoder->print_stats();
+		return 0;
+	}
+
+	DisplayQueue *display_buffer = new DisplayQueue();
 	
 	time_t t1 = time(NULL);
 
-	Demuxer *demuxer = new Demuxer(argv[1]);
+	Demuxer *demuxer = new Demuxer(file);
+	demuxer->audio_stream_id = DEMUXER_NO_STREAM;
+	demuxer->video_stream_id = video_stream_id;
+
+	VideoDecoder *video_decoder = new VideoDecoder(demuxer, display_buffer);
 
-	VideoThreadArgs *video_args = (VideoThreadArgs*)malloc(sizeof(VideoThreadArgs));
-	video_args->input_stream = demuxer->video_stream;
-	video_args->video_buffer = display_buffer;
+	if(seek_entry && !video_decoder->seek(seek_entry, seek_time)) {
+		fprintf(stderr, "Unable to seek in %s\n", file);
+		exit(1);
+	}
 
 	pthread_t video_thread;
 
-	pthread_create(&video_thread, NULL, decode_video_thread, (void*)video_args);
+	pthread_create(&video_thread, NULL, decode_video_thread, (void*)video_decoder);
+
+	// Frames are shown at their PTS, on a clock that starts with the first one
+	using std::chrono::steady_clock;
+	using std::chrono::duration;
+
+	bool clock_started = false;
+	double clock_start_pts = 0;
+	steady_clock::time_point clock_start;
+
+	// Reused for every frame of the same size
+	Mat *image = nullptr;
+
+	// Until the decoder closes the queue at the end of the stream
+	DisplayFrame display;
+	while(display_buffer->pop(&display)) {
+		Frame *frame = display.frame;
+		if(!image || image->cols != frame->width || image->rows != frame->height) {
+			delete image;
+			image = new Mat(frame->height, frame->width, CV_8UC3);
+		}
 
-	usleep(40*25*10 * 1000);
-	int delay = 1000/30 - 10;
-	Mat *display;
+		VideoDecoder::frame_to_rgb(frame, image);
+		frame->pool->release(frame);
 
-	while(true) {
-		while(display_buffer->empty()) {
-			usleep(100* 1000);
+		if(!clock_started) {
+			clock_started = true;
+			clock_start_pts = display.pts;
+			clock_start = steady_clock::now();
 		}
 
-		display = display_buffer->front();
-		display_buffer->pop();
+		duration<double> elapsed = steady_clock::now() - clock_start;
+		int delay = (int)((display.pts - clock_start_pts - elapsed.count()) * 1000);
 
-		imshow("Display window", *display);
-		if(cvWaitKey(delay)==27) {
+		// A late frame is shown right away
+		if(delay > 0 && cvWaitKey(delay)==27) {
+			break;
+		}
+
+		imshow("Display window", *image);
+		if(cvWaitKey(1)==27) {
 			break;
 		}
 	}
 
+	// Unblocks and stops the decoder when playback was ended early
+	display_buffer->close();
+
+	demuxer->print_stats();
+
 	pthread_join(video_thread, NULL);
+	video_decoder->print_stats();
+
+	if(audio_decoder) {
+		pthread_join(audio_thread, NULL);
+		audio_decoder->print_stats();
+	}
 
 	return 1;
 }
 
 void* decode_video_thread(void *args) {
-	auto video_args = (VideoThreadArgs*)args;
-	auto video_stream = (BitStream*)video_args->input_stream;
-	auto video_buffer = (queue<Mat *>*)video_args->video_buffer;
-
-	VideoDecoder *video_decoder = new VideoDecoder(video_stream, video_buffer);
+	auto video_decoder = (VideoDecoder*)args;
 	video_decoder->decode();
 
 	pthread_exit(NULL);
 }
+
+void* decode_audio_thread(void *args) {
+	auto audio_decoder = (AudioDecoder*)args;
+	audio_decoder->decode();
+
+	pthread_exit(NULL);
+}